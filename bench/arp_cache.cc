@@ -0,0 +1,104 @@
+#include "arp.h"
+
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <stdio.h>
+
+using namespace unet;
+
+namespace
+{
+	// The std::set based cache arp_cache replaced, kept as the baseline.
+	class set_cache
+	{
+		struct entry
+		{
+			uint32_t sip;
+			uint16_t hwtype;
+			mutable uint8_t smac[6];
+
+			entry(uint32_t sip, uint16_t hwtype) : sip(sip), hwtype(hwtype) {}
+
+			bool operator<(const entry &other) const
+			{
+				return hwtype < other.hwtype || (hwtype == other.hwtype && sip < other.sip);
+			}
+		};
+
+		std::set<entry> set;
+		mutable std::shared_timed_mutex lock;
+
+	public:
+		bool add(uint32_t ip, const uint8_t *mac, arphrd hwtype = ARPHRD_ETHER)
+		{
+			std::lock_guard<std::shared_timed_mutex> guard(lock);
+			auto it = set.emplace(ip, hwtype);
+			memcpy(it.first->smac, mac, sizeof(it.first->smac));
+			return it.second;
+		}
+
+		bool find(uint32_t ip, uint8_t *mac, arphrd hwtype = ARPHRD_ETHER) const
+		{
+			std::shared_lock<std::shared_timed_mutex> guard(lock);
+			auto it = set.find(entry(ip, hwtype));
+			if (it == set.end()) { return false; }
+			memcpy(mac, it->smac, sizeof(it->smac));
+			return true;
+		}
+	};
+
+	using bench_clock = std::chrono::steady_clock;
+
+	template <typename Cache>
+	double run(Cache &cache, const std::vector<uint32_t> &ips,
+			const std::vector<uint32_t> &probe, size_t &hits)
+	{
+		static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+		uint8_t out[6];
+
+		for (uint32_t ip : ips) { cache.add(ip, mac); }
+
+		auto start = bench_clock::now();
+		for (uint32_t ip : probe) {
+			hits += cache.find(ip, out);
+		}
+		std::chrono::duration<double, std::nano> ns = bench_clock::now() - start;
+		return ns.count() / probe.size();
+	}
+}
+
+int main()
+{
+	static const size_t sizes[] = { 16, 256, 4096, 32768, 65536 };
+	static const size_t lookups = 4000000;
+
+	std::mt19937 rng(0x5eed);
+	printf("%-10s %12s %12s %8s\n", "neighbors", "set ns/op", "flat ns/op", "speedup");
+
+	for (size_t n : sizes) {
+		// 10.0.0.0/8 addresses; every fourth probe misses.
+		std::vector<uint32_t> ips(n);
+		for (auto &ip : ips) { ip = 0x0a000000 | (rng() & 0xffffff); }
+
+		std::vector<uint32_t> probe(lookups);
+		for (size_t i = 0; i < lookups; i++) {
+			probe[i] = (i & 3) ? ips[rng() % n] : 0x0b000000 | (rng() & 0xffffff);
+		}
+
+		size_t set_hits = 0, flat_hits = 0;
+		set_cache old;
+		arp_cache flat;
+		double set_ns = run(old, ips, probe, set_hits);
+		double flat_ns = run(flat, ips, probe, flat_hits);
+
+		if (set_hits != flat_hits) {
+			fprintf(stderr, "hit mismatch: set=%zu flat=%zu\n", set_hits, flat_hits);
+			return 1;
+		}
+		printf("%-10zu %12.2f %12.2f %7.2fx\n", n, set_ns, flat_ns, set_ns / flat_ns);
+	}
+	return 0;
+}
@@ -0,0 +1,470 @@
+#include "device.h"
+#include "pool.h"
+#include "csum.h"
+#include "log.h"
+#include "vlan.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+
+using namespace unet;
+
+namespace
+{
+	struct result
+	{
+		std::string name;
+		size_t size;        /* input size the benchmark was run at, 0 if none */
+		size_t ops;         /* operations per run */
+		uint64_t cycles;    /* median TSC cycles per run */
+	};
+
+	const int runs = 7;
+	std::vector<result> results;
+	const char *only = nullptr;
+
+	template <typename T>
+	inline void keep(const T &v) { asm volatile("" :: "g"(v) : "memory"); }
+
+	inline uint64_t cycles()
+	{
+		_mm_lfence();
+		uint64_t t = __rdtsc();
+		_mm_lfence();
+		return t;
+	}
+
+	// TSC ticks per nanosecond, measured against the steady clock.
+	double tsc_ghz()
+	{
+		using clock = std::chrono::steady_clock;
+		auto t0 = clock::now();
+		uint64_t c0 = cycles();
+		while (clock::now() - t0 < std::chrono::milliseconds(100)) {}
+		std::chrono::duration<double, std::nano> ns = clock::now() - t0;
+		return (cycles() - c0) / ns.count();
+	}
+
+	/**
+	 * Runs fn, which does ops operations, once to warm up and then runs
+	 * times, and keeps the median. Anything fn sets up for itself is part
+	 * of the measurement, so setup has to be small next to ops.
+	 */
+	template <typename F>
+	void measure(const char *name, size_t size, size_t ops, F fn)
+	{
+		if (only && !strstr(name, only)) { return; }
+
+		uint64_t t[runs];
+		fn();
+		for (auto &v : t) {
+			uint64_t start = cycles();
+			fn();
+			v = cycles() - start;
+		}
+		std::sort(t, t + runs);
+		results.push_back(result{name, size, ops, t[runs / 2]});
+	}
+
+	void print_json(double ghz)
+	{
+		printf("{\n");
+		printf("  \"tsc_ghz\": %.3f,\n", ghz);
+		printf("  \"runs\": %d,\n", runs);
+		printf("  \"benchmarks\": [\n");
+		for (size_t i = 0; i < results.size(); i++) {
+			const result &r = results[i];
+			double cpo = (double)r.cycles / r.ops;
+			double ns = cpo / ghz;
+			printf("    {\"name\": \"%s\", \"size\": %zu, \"ops\": %zu, "
+					"\"cycles_per_op\": %.2f, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f}%s\n",
+					r.name.c_str(), r.size, r.ops, cpo, ns, 1e9 / ns,
+					i + 1 < results.size() ? "," : "");
+		}
+		printf("  ]\n");
+		printf("}\n");
+	}
+
+	void bench_slice(std::mt19937 &rng)
+	{
+		static const size_t sizes[] = { 6, 64, 1500 };
+		const size_t ops = 1000000;
+
+		std::vector<uint8_t> a(1500), b(1500);
+		for (auto &v : a) { v = 'a' + rng() % 26; }
+		b = a;
+		a.back() = b.back() = '!';
+
+		// Equal inputs, so every octet is compared.
+		for (size_t n : sizes) {
+			measure("slice.compare", n, ops, [&] {
+				slice x(a.data() + a.size() - n, n);
+				slice y(b.data() + b.size() - n, n);
+				for (size_t i = 0; i < ops; i++) {
+					keep(&x);
+					keep(x.compare(y));
+				}
+			});
+		}
+
+		// The octet looked for is the last one.
+		for (size_t n : sizes) {
+			measure("slice.find", n, ops, [&] {
+				slice x(a.data() + a.size() - n, n);
+				for (size_t i = 0; i < ops; i++) {
+					keep(&x);
+					keep(x.find('!'));
+				}
+			});
+		}
+
+		measure("slice.sub", 1500, ops, [&] {
+			slice x(a.data(), a.size());
+			for (size_t i = 0; i < ops; i++) {
+				keep(&x);
+				slice s = x.sub(i & 2047, 64);
+				keep(s.length());
+			}
+		});
+	}
+
+	struct node : ilist<node, struct node_keep>::entry
+	{
+		uint64_t val = 0;
+	};
+
+	struct node_keep
+	{
+		void operator()(node *) const noexcept {}
+	};
+
+	using node_list = ilist<node, node_keep>;
+
+	void bench_ilist()
+	{
+		const size_t ops = 1000000;
+		static const size_t sizes[] = { 1, 64 };
+
+		// Each op moves one node from the front to the back.
+		for (size_t n : sizes) {
+			measure("ilist.push_pop", n, ops, [&] {
+				std::unique_ptr<node[]> nodes(new node[n]);
+				node_list list;
+				for (size_t i = 0; i < n; i++) { list.push_back(nodes[i]); }
+				for (size_t i = 0; i < ops; i++) {
+					node &e = list.front();
+					list.pop_front();
+					list.push_back(e);
+				}
+				list.clear();
+			});
+		}
+
+		// Each op moves a whole list onto the end of the other.
+		measure("ilist.splice", 64, ops, [&] {
+			std::unique_ptr<node[]> nodes(new node[64]);
+			node_list a, b;
+			for (size_t i = 0; i < 64; i++) { a.push_back(nodes[i]); }
+			for (size_t i = 0; i < ops; i += 2) {
+				b.splice_back(a);
+				a.splice_back(b);
+			}
+			a.clear();
+		});
+	}
+
+	void bench_buffer()
+	{
+		const size_t ops = 1000000;
+		const unsigned int size = 2048;
+
+		measure("buffer.create", size, ops, [&] {
+			for (size_t i = 0; i < ops; i++) {
+				buffer::unique_ptr buf(buffer::create(size));
+				keep(buf.get());
+			}
+		});
+
+		buffer_pool pool(size);
+		measure("buffer.pool", size, ops, [&] {
+			for (size_t i = 0; i < ops; i++) {
+				buffer::unique_ptr buf(pool.acquire());
+				keep(buf.get());
+			}
+		});
+
+		measure("buffer.pool_cached", size, ops, [&] {
+			buffer_cache cache(pool);
+			for (size_t i = 0; i < ops; i++) {
+				buffer::unique_ptr buf(pool.acquire());
+				keep(buf.get());
+			}
+		});
+	}
+
+	void bench_arp(std::mt19937 &rng)
+	{
+		static const size_t sizes[] = { 16, 256, 4096, 65536 };
+		static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+		const size_t ops = 1000000;
+
+		for (size_t n : sizes) {
+			std::vector<uint32_t> ips(n);
+			for (auto &ip : ips) { ip = 0x0a000000 | (rng() & 0xffffff); }
+
+			// Every fourth probe misses.
+			std::vector<uint32_t> probe(ops);
+			for (size_t i = 0; i < ops; i++) {
+				probe[i] = (i & 3) ? ips[rng() % n] : 0x0b000000 | (rng() & 0xffffff);
+			}
+
+			// A fresh cache per run, so every op is an insert.
+			measure("arp_cache.add", n, n, [&] {
+				arp_cache cache(n);
+				for (uint32_t ip : ips) { keep(cache.add(ip, mac)); }
+			});
+
+			arp_cache cache(n);
+			for (uint32_t ip : ips) { cache.add(ip, mac); }
+			measure("arp_cache.find", n, ops, [&] {
+				uint8_t out[6];
+				for (uint32_t ip : probe) { keep(cache.find(ip, out)); }
+			});
+		}
+	}
+
+	// Swallows and counts whatever the stack sends.
+	class sink_device final : public device
+	{
+	public:
+		size_t frames = 0;
+
+		sink_device()
+		{
+			addr = hton32(0x0a000004);
+			memcpy(hw, "\x00\x0c\x29\x6d\x50\x25", sizeof(hw));
+		}
+
+		void close() override {}
+		std::error_code read_burst(buffer_list &, buffer_pool &, unsigned int) override { return std::error_code(); }
+		std::error_code read(buffer &) override { return std::error_code(); }
+
+		ssize_t write(const slice &buf, const buffer_offload &) override
+		{
+			frames++;
+			return buf.length();
+		}
+
+		ssize_t write(buffer_list &pkt, const buffer_offload &) override
+		{
+			frames++;
+			return pkt.front().length();
+		}
+	};
+
+	std::vector<uint8_t> make_eth(const uint8_t *dmac, const uint8_t *smac, eth_type type, size_t len)
+	{
+		std::vector<uint8_t> f(len);
+		eth_hdr &hdr = *reinterpret_cast<eth_hdr *>(f.data());
+		memcpy(hdr.dmac, dmac, 6);
+		memcpy(hdr.smac, smac, 6);
+		hdr.set_type(type);
+		return f;
+	}
+
+	std::vector<uint8_t> make_arp(const sink_device &dev, const uint8_t *smac, uint32_t dip)
+	{
+		auto f = make_eth(broadcast_hwaddr, smac, ETH_ARP, UNET_ETH_ZLEN);
+		arp_hdr &hdr = *reinterpret_cast<arp_hdr *>(f.data() + UNET_ETH_HLEN);
+		hdr.hwtype = hton16(ARPHRD_ETHER);
+		hdr.protype = hton16(ARPPROTO_IP4);
+		hdr.hwsize = 6;
+		hdr.prosize = 4;
+		hdr.opcode = hton16(ARPOP_REQUEST);
+
+		arp_ip data;
+		memcpy(data.smac, smac, 6);
+		data.sip = hton32(0x0a000005);
+		memset(data.dmac, 0, 6);
+		data.dip = dip == 0 ? dev.ipaddr() : hton32(dip);
+		memcpy(hdr.data, &data, sizeof(data));
+		return f;
+	}
+
+	// A reply from sip to the device's request for it.
+	std::vector<uint8_t> make_arp_reply(const sink_device &dev, const uint8_t *smac, uint32_t sip)
+	{
+		auto f = make_arp(dev, smac, 0);
+		arp_hdr &hdr = *reinterpret_cast<arp_hdr *>(f.data() + UNET_ETH_HLEN);
+		hdr.opcode = hton16(ARPOP_REPLY);
+		arp_ip &data = *reinterpret_cast<arp_ip *>(hdr.data);
+		data.sip = hton32(sip);
+		memcpy(data.dmac, dev.hwaddr(), 6);
+		return f;
+	}
+
+	std::vector<uint8_t> make_udp(const sink_device &dev, const uint8_t *smac)
+	{
+		auto f = make_eth(dev.hwaddr(), smac, ETH_IP, UNET_ETH_HLEN + UNET_IP4_HLEN + 8 + 64);
+		ip4_hdr &hdr = *reinterpret_cast<ip4_hdr *>(f.data() + UNET_ETH_HLEN);
+		hdr.ver_ihl = 0x45;
+		hdr.len = hton16(UNET_IP4_HLEN + 8 + 64);
+		hdr.ttl = UNET_IP4_DEFTTL;
+		hdr.proto = IP_PROTO_UDP;
+		hdr.saddr = hton32(0x0a000005);
+		hdr.daddr = dev.ipaddr();
+		hdr.set_check();
+		return f;
+	}
+
+	// Puts an 802.1Q tag for vid in front of the frame's type.
+	std::vector<uint8_t> make_tagged(std::vector<uint8_t> f, uint16_t vid)
+	{
+		uint16_t tag[2] = { hton16(ETH_IEEE8021Q), hton16(vid) };
+		auto *p = reinterpret_cast<const uint8_t *>(tag);
+		f.insert(f.begin() + 2 * UNET_ETH_ALEN, p, p + sizeof(tag));
+		return f;
+	}
+
+	void bench_eth()
+	{
+		static const uint8_t peer[6] = { 0x02, 0xaa, 0xbb, 0xcc, 0xdd, 0xee };
+		const size_t ops = 1000000;
+
+		sink_device dev;
+		arp_cache cache;
+		eth recvr(dev, cache);
+		buffer::unique_ptr buf(buffer::create(2048));
+
+		// Each op copies the frame in first, since handlers that reply
+		// rewrite it in place.
+		auto run = [&](const char *name, const std::vector<uint8_t> &frame) {
+			measure(name, frame.size(), ops, [&] {
+				for (size_t i = 0; i < ops; i++) {
+					buf->reserve(UNET_HEADROOM);
+					memcpy(buf->put(frame.size()), frame.data(), frame.size());
+					recvr.recv(*buf);
+				}
+				dev.flush();
+			});
+		};
+
+		run("eth.recv.unknown", make_eth(dev.hwaddr(), peer, ETH_LOOP, UNET_ETH_ZLEN));
+		run("eth.recv.arp_other", make_arp(dev, peer, 0x0a000063));
+		run("eth.recv.arp_reply", make_arp(dev, peer, 0));
+		run("eth.recv.ip_no_proto", make_udp(dev, peer));
+
+		// The VLAN has the device's address, so the frame gets as far up
+		// its stack as the untagged one does.
+		arp_cache vcache;
+		vlan_demux demux(dev, recvr);
+		if (demux.add(100, 0, "10.0.0.4", nullptr, vcache)) { return; }
+		run("eth.recv.vlan_ip_no_proto", make_tagged(make_udp(dev, peer), 100));
+		run("eth.recv.vlan_unknown", make_tagged(make_udp(dev, peer), 101));
+	}
+
+	void bench_arp_send()
+	{
+		static const uint8_t peer[6] = { 0x02, 0xaa, 0xbb, 0xcc, 0xdd, 0xee };
+		const size_t ops = 1000000;
+		const size_t n = 65536;
+		const uint32_t next_hop = 0x0a000005;
+
+		sink_device dev;
+		buffer_pool pool(2048);
+
+		measure("arp.send.resolved", 0, ops, [&] {
+			arp_cache cache;
+			cache.add(next_hop, peer);
+			arp out(dev, cache);
+			for (size_t i = 0; i < ops; i++) {
+				buffer::unique_ptr frame(pool.acquire());
+				frame->put(UNET_IP4_HLEN + 8 + 64);
+				keep(out.send(std::move(frame), next_hop));
+			}
+			dev.flush();
+		});
+
+		// Each op sends to a new neighbor, which holds the frame and sends
+		// a request, then receives the reply that sends the frame on. A
+		// fresh cache per run keeps every neighbor new.
+		auto reply = make_arp_reply(dev, peer, 0);
+		const unsigned int sip_off = UNET_ETH_HLEN + UNET_ARP_HLEN + offsetof(arp_ip, sip);
+		buffer::unique_ptr buf(buffer::create(2048));
+		measure("arp.send.held", n, n, [&] {
+			arp_cache cache(n);
+			eth recvr(dev, cache);
+			for (size_t i = 0; i < n; i++) {
+				uint32_t ip = 0x0a010000 + i;
+				buffer::unique_ptr frame(pool.acquire());
+				frame->put(UNET_IP4_HLEN + 8 + 64);
+				keep(recvr.arp().send(std::move(frame), ip));
+
+				uint32_t sip = hton32(ip);
+				buf->reserve(UNET_HEADROOM);
+				uint8_t *p = buf->put(reply.size());
+				memcpy(p, reply.data(), reply.size());
+				memcpy(p + sip_off, &sip, sizeof(sip));
+				recvr.recv(*buf);
+			}
+			dev.flush();
+		});
+	}
+
+	void bench_log()
+	{
+		static const uint8_t peer[6] = { 0x02, 0xaa, 0xbb, 0xcc, 0xdd, 0xee };
+		const size_t ops = 1000000;
+
+		// Records go to /dev/null, with a ring big enough for a whole run
+		// so none of them is dropped.
+		log_config cfg;
+		cfg.path = "/dev/null";
+		cfg.ring = 64 << 20;
+		logger logs(cfg);
+		if (logs.start()) { return; }
+		log_ring &ring = logs.attach();
+
+		auto frame = make_eth(broadcast_hwaddr, peer, ETH_ARP, UNET_ETH_ZLEN);
+		measure("log.event.off", UNET_ETH_HLEN, ops, [&] {
+			for (size_t i = 0; i < ops; i++) {
+				log_event(LOG_ETH_RX, frame.data(), UNET_ETH_HLEN);
+			}
+		});
+
+		log_ring::current = &ring;
+		measure("log.event.on", UNET_ETH_HLEN, ops, [&] {
+			for (size_t i = 0; i < ops; i++) {
+				log_event(LOG_ETH_RX, frame.data(), UNET_ETH_HLEN);
+			}
+		});
+		log_ring::current = nullptr;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) { only = argv[1]; }
+
+	std::mt19937 rng(0x5eed);
+	double ghz = tsc_ghz();
+
+	bench_slice(rng);
+	bench_ilist();
+	bench_buffer();
+	bench_arp(rng);
+	bench_eth();
+	bench_arp_send();
+	bench_log();
+
+	print_json(ghz);
+	return 0;
+}
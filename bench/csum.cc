@@ -0,0 +1,114 @@
+#include "csum.h"
+#include "ip.h"
+
+#include <vector>
+#include <random>
+#include <stdio.h>
+#include <x86intrin.h>
+
+using namespace unet;
+
+namespace
+{
+	// RFC 1071 done one octet pair at a time, as the reference.
+	uint16_t reference(const uint8_t *p, size_t n)
+	{
+		uint32_t sum = 0;
+		for (size_t i = 0; i + 1 < n; i += 2) {
+			uint16_t w;
+			memcpy(&w, p + i, sizeof(w));
+			sum += w;
+		}
+		if (n & 1) {
+			uint8_t last[2] = { p[n - 1], 0 };
+			uint16_t w;
+			memcpy(&w, last, sizeof(w));
+			sum += w;
+		}
+		return csum_fold(sum);
+	}
+
+	bool verify(std::mt19937 &rng, const std::vector<uint8_t> &data)
+	{
+		for (int i = 0; i < 20000; i++) {
+			size_t off = rng() % 64;
+			size_t n = rng() % (data.size() - off);
+			uint16_t want = reference(data.data() + off, n);
+			for (int k = CSUM_SCALAR; k <= CSUM_AVX2; k++) {
+				auto kern = static_cast<csum_kernel>(k);
+				if (!csum_supported(kern)) { continue; }
+				uint16_t got = csum_fold(csum_partial(kern, data.data() + off, n));
+				if (got != want) {
+					fprintf(stderr, "%s: off=%zu n=%zu got=%04x want=%04x\n",
+							csum_kernel_name(kern), off, n, got, want);
+					return false;
+				}
+			}
+		}
+
+		// Incremental updates must match a full recompute.
+		for (int i = 0; i < 20000; i++) {
+			uint8_t raw[UNET_IP4_HLEN];
+			for (auto &b : raw) { b = rng(); }
+			ip4_hdr &hdr = *reinterpret_cast<ip4_hdr *>(raw);
+			hdr.ver_ihl = 0x45;
+			hdr.set_check();
+			hdr.set_ttl(rng());
+			hdr.set_saddr(rng());
+			hdr.set_daddr(rng());
+			if (!hdr.check_valid()) {
+				fprintf(stderr, "incremental update mismatch\n");
+				return false;
+			}
+		}
+		return true;
+	}
+
+	double bytes_per_cycle(csum_kernel k, const uint8_t *p, size_t n)
+	{
+		size_t iters = std::max<size_t>(2000, (64u << 20) / n);
+		uint32_t sink = 0;
+
+		for (size_t i = 0; i < iters / 10; i++) {
+			sink += csum_partial(k, p, n);
+		}
+
+		uint64_t start = __rdtsc();
+		for (size_t i = 0; i < iters; i++) {
+			sink += csum_partial(k, p, n, sink);
+		}
+		uint64_t cycles = __rdtsc() - start;
+
+		asm volatile("" :: "r"(sink));
+		return (double)n * iters / cycles;
+	}
+}
+
+int main()
+{
+	static const size_t sizes[] = { 20, 40, 64, 128, 256, 576, 1500, 4096, 9000, 65536 };
+
+	std::mt19937 rng(0x5eed);
+	std::vector<uint8_t> data(65536 + 64);
+	for (auto &b : data) { b = rng(); }
+
+	if (!verify(rng, data)) { return 1; }
+
+	printf("active kernel: %s\n", csum_kernel_name(csum_active()));
+	printf("%-8s", "octets");
+	for (int k = CSUM_SCALAR; k <= CSUM_AVX2; k++) {
+		auto kern = static_cast<csum_kernel>(k);
+		if (csum_supported(kern)) { printf(" %10s", csum_kernel_name(kern)); }
+	}
+	printf("   (octets/cycle)\n");
+
+	for (size_t n : sizes) {
+		printf("%-8zu", n);
+		for (int k = CSUM_SCALAR; k <= CSUM_AVX2; k++) {
+			auto kern = static_cast<csum_kernel>(k);
+			if (csum_supported(kern)) { printf(" %10.2f", bytes_per_cycle(kern, data.data(), n)); }
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -3,50 +3,350 @@
 #include "host.h"
 #include "fmt.h"
 #include "eth.h"
+#include "device.h"
+#include "log.h"
 
+#include <mutex>
 #include <stdio.h>
 
 using namespace unet;
 
-bool arp_cache::add(const arp_hdr &hdr, const arp_ip &data)
+static const uint8_t unknown_hw[6] = {};
+
+arp_cache::arp_cache(size_t hint, const arp_config &cfg) :
+	cfg(cfg), wheel(coarse_clock_ms()), ticked(wheel.now())
+{
+	size_t n = 16;
+	unsigned bits = 4;
+	while (n < hint * 2) {
+		n <<= 1;
+		bits++;
+	}
+	table.resize(n);
+	shift = 64 - bits;
+
+	// Node index 0 marks a free slot.
+	nodes.emplace_back();
+}
+
+void arp_cache::node::expired(timer &t)
+{
+	node &n = static_cast<node &>(t);
+	n.cache->timeout(n);
+}
+
+arp_cache::entry *arp_cache::lookup(uint32_t ip, uint16_t hwtype) const
+{
+	// The table is never more than half full, so the probe always ends.
+	size_t mask = table.size() - 1;
+	for (size_t i = slot(ip, hwtype);; i = (i + 1) & mask) {
+		const entry &e = table[i];
+		if (e.state == ARP_FREE) { return nullptr; }
+		if (e.ip == ip && e.hwtype == hwtype) {
+			return const_cast<entry *>(&e);
+		}
+	}
+}
+
+arp_cache::entry &arp_cache::insert(uint32_t ip, uint16_t hwtype)
+{
+	if ((count + 1) * 2 > table.size()) { grow(); }
+
+	size_t mask = table.size() - 1;
+	size_t i = slot(ip, hwtype);
+	while (table[i].state != ARP_FREE) { i = (i + 1) & mask; }
+
+	uint32_t idx;
+	if (!idle.empty()) {
+		idx = idle.back();
+		idle.pop_back();
+	}
+	else {
+		idx = nodes.size();
+		nodes.emplace_back(new node(this));
+	}
+
+	node &n = *nodes[idx];
+	n.ip = ip;
+	n.hwtype = hwtype;
+	wheel.arm(n, cfg.retry_ms * cfg.retries);
+
+	entry &e = table[i];
+	e.ip = ip;
+	e.hwtype = hwtype;
+	e.state = ARP_INCOMPLETE;
+	e.node = idx;
+	count++;
+	return e;
+}
+
+void arp_cache::erase(entry &e)
+{
+	node &n = *nodes[e.node];
+	wheel.cancel(n);
+	n.frames.clear();
+	n.count = 0;
+	n.bytes = 0;
+	n.requested = 0;
+	idle.push_back(e.node);
+
+	// Shift later entries of the probe run back into the hole, unless
+	// their home slot lies after it.
+	size_t mask = table.size() - 1;
+	size_t i = &e - table.data();
+	for (size_t j = (i + 1) & mask; table[j].state != ARP_FREE; j = (j + 1) & mask) {
+		size_t k = slot(table[j].ip, table[j].hwtype);
+		bool stays = i < j ? (k > i && k <= j) : (k > i || k <= j);
+		if (!stays) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i] = entry();
+	count--;
+}
+
+void arp_cache::grow()
+{
+	std::vector<entry> old(table.size() * 2);
+	table.swap(old);
+	shift--;
+
+	size_t mask = table.size() - 1;
+	for (const entry &e : old) {
+		if (e.state == ARP_FREE) { continue; }
+		size_t i = slot(e.ip, e.hwtype);
+		while (table[i].state != ARP_FREE) { i = (i + 1) & mask; }
+		table[i] = e;
+	}
+}
+
+void arp_cache::resolve(entry &e, const uint8_t *mac, buffer_list *held)
+{
+	node &n = *nodes[e.node];
+	memcpy(e.mac, mac, sizeof(e.mac));
+	e.state = ARP_RESOLVED;
+
+	if (held) { held->splice_back(n.frames); }
+	else { n.frames.clear(); }
+	n.count = 0;
+	n.bytes = 0;
+	n.requested = 0;
+	wheel.arm(n, cfg.reachable_ms);
+}
+
+void arp_cache::timeout(node &n)
+{
+	entry *e = lookup(n.ip, n.hwtype);
+	if (e == nullptr) { return; }
+
+	if (e->state == ARP_RESOLVED) {
+		e->state = ARP_STALE;
+		wheel.arm(n, cfg.stale_ms);
+	}
+	else {
+		erase(*e);
+	}
+}
+
+bool arp_cache::add(const arp_hdr &hdr, const arp_ip &data, buffer_list *held)
+{
+	return add(ntoh32(data.sip), data.smac, static_cast<arphrd>(ntoh16(hdr.hwtype)), held);
+}
+
+bool arp_cache::add(uint32_t ip, const uint8_t *mac, arphrd hwtype, buffer_list *held)
 {
-	return add(data.sip, data.smac, static_cast<arphrd>(hdr.hwtype));
+	std::lock_guard<std::shared_timed_mutex> guard(lock);
+	entry *e = lookup(ip, hwtype);
+	bool added = e == nullptr;
+	if (added) { e = &insert(ip, hwtype); }
+	resolve(*e, mac, held);
+	return added;
 }
 
-bool arp_cache::add(uint32_t ip, const uint8_t *mac, arphrd hwtype)
+bool arp_cache::update(const arp_hdr &hdr, const arp_ip &data, buffer_list *held)
 {
-	auto it = set.emplace(hwtype, ip);
-	it.first->setmac(mac);
-	return it.second;
+	return update(ntoh32(data.sip), data.smac, static_cast<arphrd>(ntoh16(hdr.hwtype)), held);
 }
 
-bool arp_cache::update(const arp_hdr &hdr, const arp_ip &data)
+bool arp_cache::update(uint32_t ip, const uint8_t *mac, arphrd hwtype, buffer_list *held)
 {
-	return update(data.sip, data.smac, static_cast<arphrd>(hdr.hwtype));
+	std::lock_guard<std::shared_timed_mutex> guard(lock);
+	entry *e = lookup(ip, hwtype);
+	if (e == nullptr) { return false; }
+	resolve(*e, mac, held);
+	return true;
 }
 
-bool arp_cache::update(uint32_t ip, const uint8_t *mac, arphrd hwtype)
+bool arp_cache::find(uint32_t ip, uint8_t *mac, arphrd hwtype) const
 {
-	entry e(ip, hwtype);
-	auto it = set.find(e);
-	if (it != set.end()) {
-		it->setmac(mac);
+	std::shared_lock<std::shared_timed_mutex> guard(lock);
+	const entry *e = lookup(ip, hwtype);
+	if (e == nullptr || e->state == ARP_INCOMPLETE) { return false; }
+	memcpy(mac, e->mac, sizeof(e->mac));
+	return true;
+}
+
+arp_hold_result arp_cache::hold(uint32_t ip, buffer::unique_ptr &frame, uint8_t *mac,
+		arphrd hwtype)
+{
+	{
+		std::shared_lock<std::shared_timed_mutex> guard(lock);
+		const entry *e = lookup(ip, hwtype);
+		if (e != nullptr && e->state == ARP_RESOLVED) {
+			memcpy(mac, e->mac, sizeof(e->mac));
+			return ARP_HOLD_RESOLVED;
+		}
+	}
+
+	std::lock_guard<std::shared_timed_mutex> guard(lock);
+	entry *e = lookup(ip, hwtype);
+	if (e == nullptr) { e = &insert(ip, hwtype); }
+
+	node &n = *nodes[e->node];
+	uint64_t now = wheel.now();
+	bool request = n.requested == 0 || now - n.requested >= cfg.retry_ms;
+
+	if (e->state == ARP_RESOLVED) {
+		memcpy(mac, e->mac, sizeof(e->mac));
+		return ARP_HOLD_RESOLVED;
+	}
+	if (request) { n.requested = now; }
+	if (e->state == ARP_STALE) {
+		memcpy(mac, e->mac, sizeof(e->mac));
+		return request ? ARP_HOLD_PROBE : ARP_HOLD_RESOLVED;
+	}
+
+	unsigned int len = frame->length();
+	if (!frame->is_external() && n.count < cfg.frames && n.bytes + len <= cfg.bytes) {
+		n.frames.push_back(*frame.release());
+		n.count++;
+		n.bytes += len;
+		return request ? ARP_HOLD_REQUEST : ARP_HOLD_QUEUED;
+	}
+	return request ? ARP_HOLD_REQUEST : ARP_HOLD_DROPPED;
+}
+
+void arp_cache::expire(uint64_t now)
+{
+	if (now <= ticked.load(std::memory_order_relaxed)) { return; }
+
+	// Whoever gets the lock first runs the timers for everyone.
+	std::unique_lock<std::shared_timed_mutex> guard(lock, std::try_to_lock);
+	if (!guard.owns_lock()) { return; }
+	wheel.advance(now);
+	ticked.store(now, std::memory_order_relaxed);
+}
+
+size_t arp_cache::size() const
+{
+	std::shared_lock<std::shared_timed_mutex> guard(lock);
+	return count;
+}
+
+void arp::recv(buffer &buf, const slice &val)
+{
+	st.received++;
+	if (val.length() < UNET_ARP_HLEN + UNET_ARP_DLEN) {
+		st.bad++;
+		return;
+	}
+	log_event(LOG_ARP, val.value(), UNET_ARP_HLEN + UNET_ARP_DLEN);
+
+	unsigned int off = val.value() - buf.data();
+	arp_hdr &hdr = *reinterpret_cast<arp_hdr *>(buf.data() + off);
+	if (hdr.hwtype != hton16(ARPHRD_ETHER) || hdr.protype != hton16(ARPPROTO_IP4) ||
+			hdr.hwsize != 6 || hdr.prosize != 4) {
+		st.bad++;
+		return;
+	}
+
+	arp_ip &data = *reinterpret_cast<arp_ip *>(hdr.data);
+	bool local = data.dip == dev->ipaddr();
+
+	// RFC 826: refresh a sender we already know whatever the packet is
+	// for, and only add one that is talking to us. Probes (RFC 5227) have
+	// no sender address to learn.
+	if (data.sip != 0) {
+		buffer_list held;
+		bool merged = cache->update(hdr, data, &held);
+		if (merged) {
+			flush(held, data.smac);
+		}
+		else if (local) {
+			cache->add(hdr, data);
+		}
+		st.learned += merged || local;
+	}
+
+	if (local && hdr.opcode == hton16(ARPOP_REQUEST)) {
+		reply(buf, hdr, data);
+	}
+}
+
+void arp::reply(buffer &buf, arp_hdr &hdr, arp_ip &data)
+{
+	memcpy(data.dmac, data.smac, sizeof(data.dmac));
+	data.dip = data.sip;
+	memcpy(data.smac, dev->hwaddr(), sizeof(data.smac));
+	data.sip = dev->ipaddr();
+	hdr.opcode = hton16(ARPOP_REPLY);
+
+	buf.truncate(UNET_ETH_ZLEN);
+	buf.pull(reinterpret_cast<uint8_t *>(&hdr) - buf.data());
+	buf.offload() = buffer_offload();
+	if (dev->transmit(buf, data.dmac, ETH_ARP) >= 0) {
+		st.replies++;
+	}
+}
+
+bool arp::send(buffer::unique_ptr frame, uint32_t ip)
+{
+	uint8_t mac[6];
+	switch (cache->hold(ip, frame, mac)) {
+	case ARP_HOLD_PROBE:
+		send_request(ip);
+		// fall through
+	case ARP_HOLD_RESOLVED:
+		st.hits++;
+		if (dev->transmit(*frame, mac, ETH_IP) >= 0) { return true; }
+		break;
+	case ARP_HOLD_REQUEST:
+		send_request(ip);
+		st.misses++;
+		if (!frame) { return true; }
+		break;
+	case ARP_HOLD_QUEUED:
+		st.misses++;
 		return true;
+	case ARP_HOLD_DROPPED:
+		st.misses++;
+		break;
 	}
+	st.dropped++;
 	return false;
 }
 
-const uint8_t *arp_cache::find(uint32_t ip, arphrd hwtype)
+void arp::send_request(uint32_t ip)
 {
-	entry e(ip, hwtype);
-	const auto it = set.find(e);
-	return it == set.end() && it->resolved ? nullptr : it->smac;
+	// The request goes out through transmit like any other frame, which
+	// puts the device's header, and its VLAN tags, in the headroom.
+	const unsigned int len = UNET_ETH_ZLEN - UNET_ETH_HLEN;
+	buffer::unique_ptr buf(buffer::create(len));
+	uint8_t *p = buf->put(len);
+	memset(p, 0, len);
+
+	slice val(p, UNET_ARP_HLEN + UNET_ARP_DLEN);
+	request(val, ntoh32(dev->ipaddr()), dev->hwaddr(), ip, unknown_hw);
+	dev->transmit(*buf, broadcast_hwaddr, ETH_ARP);
 }
 
-void arp::recv(const slice &val)
+void arp::flush(buffer_list &held, const uint8_t *mac)
 {
-	const arp_hdr &hdr = val.as<arp_hdr>();
-	fio::out() << hdr << fio::endl;
+	for (auto &buf : held) {
+		dev->transmit(buf, mac, ETH_IP);
+	}
+	held.clear();
 }
 
 void arp::request(slice &val, uint32_t sip, const uint8_t *smac, uint32_t dip, const uint8_t *dmac)
@@ -67,9 +367,9 @@ void arp::request(slice &val, uint32_t sip, const uint8_t *smac, uint32_t dip, c
 	arp.prosize = 4;
 }
 
-const uint8_t *arp::find_hwaddr(uint32_t ip, arphrd hwtype)
+bool arp::find_hwaddr(uint32_t ip, uint8_t *mac, arphrd hwtype) const
 {
-	return cache.find(ip, hwtype);
+	return cache->find(ip, mac, hwtype);
 }
 
 const char *unet::arphrd_name(arphrd type)
@@ -102,22 +402,27 @@ const char *unet::arpop_name(arpop type)
 	return "(unknown)";
 }
 
+int unet::arp_format(char *buf, size_t len, const arp_hdr &hdr)
+{
+	const char *hrd = arphrd_name(static_cast<arphrd>(ntoh16(hdr.hwtype)));
+	const char *pro = arpproto_name(static_cast<arpproto>(ntoh16(hdr.protype)));
+	const char *op = arpop_name(static_cast<arpop>(ntoh16(hdr.opcode)));
+	if (hdr.protype != hton16(ARPPROTO_IP4)) {
+		return snprintf(buf, len, "arp (hrd=%s pro=%s op=%s)", hrd, pro, op);
+	}
+
+	const arp_ip &d = *reinterpret_cast<const arp_ip *>(hdr.data);
+	return snprintf(buf, len, "arp (hrd=%s pro=%s op=%s "
+			UNET_IP4_FMT "@" UNET_MAC_FMT "->" UNET_IP4_FMT "@" UNET_MAC_FMT ")",
+			hrd, pro, op,
+			UNET_IP4_ARG(d.sip), UNET_MAC_ARG(d.smac),
+			UNET_IP4_ARG(d.dip), UNET_MAC_ARG(d.dmac));
+}
+
 fio::ostream &operator<<(fio::ostream &os, const unet::arp_hdr &v)
 {
 	char buf[512];
-	int len = snprintf(buf, sizeof(buf), "arp (hrd=%s pro=%s op=%s",
-			unet::arphrd_name(static_cast<unet::arphrd>(ntoh16(v.hwtype))),
-			unet::arpproto_name(static_cast<unet::arpproto>(ntoh16(v.protype))),
-			unet::arpop_name(static_cast<unet::arpop>(ntoh16(v.opcode))));
-	os.write(buf, len);
-	if (v.protype == hton16(ARPPROTO_IP4)) {
-		const arp_ip &d = *reinterpret_cast<const arp_ip *>(v.data);
-		len = snprintf(buf, sizeof(buf), UNET_IP4_FMT "@" UNET_MAC_FMT "->" UNET_IP4_FMT "@" UNET_MAC_FMT,
-				UNET_IP4_ARG(d.sip), UNET_MAC_ARG(d.smac),
-				UNET_IP4_ARG(d.dip), UNET_MAC_ARG(d.dmac));
-		os << ' ';
-		os.write(buf, len);
-	}
-	return os << ')';
+	int len = unet::arp_format(buf, sizeof(buf), v);
+	return os.write(buf, len);
 }
 
@@ -1,13 +1,18 @@
 #ifndef UNET_ARP_H
 #define UNET_ARP_H
 
-#include <set>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <atomic>
 #include <cstring>
 #include <cstdint>
 
 #include "fio/fio.h"
 #include "base.h"
 #include "slice.h"
+#include "buffer.h"
+#include "timer.h"
 
 #define UNET_ARP_HLEN       8    /* Total octets in header. */
 #define UNET_ARP_DLEN       20   /* Total octets in IPv4 data. */
@@ -86,58 +91,189 @@ namespace unet
 		uint32_t dip;
 	} __attribute__((packed));
 
-	class arp_cache
+	class device;
+
+	enum arp_state : uint8_t
+	{
+		ARP_FREE       = 0, /* Unused table slot */
+		ARP_INCOMPLETE = 1, /* Request sent, waiting for a reply */
+		ARP_RESOLVED   = 2, /* Hardware address recently confirmed */
+		ARP_STALE      = 3, /* Hardware address usable but unconfirmed */
+	};
+
+	enum arp_hold_result
+	{
+		ARP_HOLD_RESOLVED, /* Address known, send the frame now */
+		ARP_HOLD_PROBE,    /* Address stale, send the frame and a request */
+		ARP_HOLD_QUEUED,   /* Frame held until the neighbor resolves */
+		ARP_HOLD_REQUEST,  /* Caller must send a request */
+		ARP_HOLD_DROPPED,  /* Frame not held: queue full */
+	};
+
+	struct arp_config
+	{
+		unsigned int frames = 16;         /* held frames per neighbor */
+		size_t bytes = 64 * 1024;         /* held octets per neighbor */
+		uint64_t retry_ms = 1000;         /* min. time between requests */
+		unsigned int retries = 3;         /* retry intervals before giving up */
+		uint64_t reachable_ms = 30000;    /* resolved until stale */
+		uint64_t stale_ms = 60000;        /* stale until removed */
+	};
+
+	/**
+	 * Neighbor table keyed by (hardware type, IPv4 address) with the MAC
+	 * stored inline. Entries live in a flat, linearly probed array sized to
+	 * a power of two and kept at most half full, so a lookup usually stays
+	 * within a single cache line.
+	 *
+	 * Everything not needed for a lookup lives in a per-neighbor node
+	 * outside the table: the queue of frames waiting on resolution, and the
+	 * timer that moves the entry from resolved to stale and then removes it.
+	 * Timers run off the cache's own wheel, advanced by expire.
+	 */
+	class arp_cache : private nocopy
 	{
 		struct entry
 		{
-			uint32_t sip;
+			uint32_t ip;
 			uint16_t hwtype;
-			mutable uint8_t smac[6];
-			mutable bool resolved;
-
-			entry(uint32_t sip, uint16_t hwtype = ARPHRD_ETHER)
-				: sip(sip), hwtype(hwtype), resolved(false) {}
-
-			void setmac(const uint8_t *mac) const
-			{
-				memcpy(smac, mac, sizeof(smac));
-				resolved = true;
-			}
-
-			bool operator<(const entry &other) const
-			{
-				return hwtype < other.hwtype || (hwtype == other.hwtype && sip < other.sip);
-			}
-
-			bool operator==(const entry &other) const
-			{
-				return hwtype == other.hwtype && sip == other.sip;
-			}
+			uint8_t  mac[6];
+			uint32_t state : 2;  /* arp_state */
+			uint32_t node : 30;  /* index into nodes, 0 if free */
+		};
+
+		static_assert(sizeof(entry) == 16, "arp_cache::entry size invalid");
+
+		struct node : timer
+		{
+			arp_cache *cache;
+			uint32_t ip = 0;
+			uint16_t hwtype = 0;
+			buffer_list frames;
+			unsigned int count = 0;
+			size_t bytes = 0;
+			uint64_t requested = 0;
+
+			explicit node(arp_cache *cache) : timer(expired), cache(cache) {}
+			static void expired(timer &t);
 		};
 
-		std::set<entry> set;
+		std::vector<entry> table;
+		size_t count = 0;
+		unsigned shift;
+
+		arp_config cfg;
+		std::vector<std::unique_ptr<node>> nodes;
+		std::vector<uint32_t> idle;
+		timer_wheel wheel;
+		std::atomic<uint64_t> ticked;
+
+		mutable std::shared_timed_mutex lock;
+
+		size_t slot(uint32_t ip, uint16_t hwtype) const
+		{
+			uint64_t key = (uint64_t)hwtype << 32 | ip;
+			return (size_t)((key * 0x9e3779b97f4a7c15ull) >> shift);
+		}
+
+		entry *lookup(uint32_t ip, uint16_t hwtype) const;
+		entry &insert(uint32_t ip, uint16_t hwtype);
+		void erase(entry &e);
+		void grow();
+
+		void resolve(entry &e, const uint8_t *mac, buffer_list *held);
+		void timeout(node &n);
 
 	public:
-		bool add(const arp_hdr &hdr, const arp_ip &data);
-		bool add(uint32_t ip, const uint8_t *mac, arphrd hwtype = ARPHRD_ETHER);
-		bool update(const arp_hdr &hdr, const arp_ip &data);
-		bool update(uint32_t ip, const uint8_t *mac, arphrd hwtype = ARPHRD_ETHER);
-		const uint8_t *find(uint32_t ip, arphrd hwtype = ARPHRD_ETHER);
+		explicit arp_cache(size_t hint = 64, const arp_config &cfg = arp_config());
+
+		// Frames held for the neighbor are moved onto held, or dropped if
+		// it is null, once its address is known.
+		bool add(const arp_hdr &hdr, const arp_ip &data, buffer_list *held = nullptr);
+		bool add(uint32_t ip, const uint8_t *mac, arphrd hwtype = ARPHRD_ETHER, buffer_list *held = nullptr);
+		bool update(const arp_hdr &hdr, const arp_ip &data, buffer_list *held = nullptr);
+		bool update(uint32_t ip, const uint8_t *mac, arphrd hwtype = ARPHRD_ETHER, buffer_list *held = nullptr);
+		bool find(uint32_t ip, uint8_t *mac, arphrd hwtype = ARPHRD_ETHER) const;
+
+		/**
+		 * Finds the address for ip, or holds frame until it is known. A new
+		 * neighbor gets an incomplete entry, and ARP_HOLD_REQUEST is returned
+		 * at most once per retry interval so a burst of frames to the same
+		 * neighbor sends a single request; stale neighbors are probed the
+		 * same way. A held frame is taken out of frame; one that can't be
+		 * held, including any attached to device memory, is left there for
+		 * the caller to drop.
+		 */
+		arp_hold_result hold(uint32_t ip, buffer::unique_ptr &frame, uint8_t *mac,
+				arphrd hwtype = ARPHRD_ETHER);
+
+		/**
+		 * Runs the entry timers up to now, in coarse_clock_ms time. Cheap
+		 * to call on every burst from every thread sharing the cache.
+		 */
+		void expire(uint64_t now);
+
+		size_t size() const;
 	};
 
-	class arp
+	class arp : private nocopy
 	{
-		arp_cache cache;
+	public:
+		struct stats
+		{
+			size_t received;      /* packets handed to recv */
+			size_t bad;           /* truncated or not Ethernet/IPv4 */
+			size_t learned;       /* senders added or refreshed in the cache */
+			size_t replies;       /* requests for our address answered */
+			size_t hits;          /* sends with the next hop's address known */
+			size_t misses;        /* sends held or dropped to resolve the next hop */
+			size_t dropped;       /* sends dropped: hold queue full or failed to transmit */
+		};
+
+	private:
+		device *dev;
+		std::unique_ptr<arp_cache> own;
+		arp_cache *cache;
+		stats st = {};
+
+		void send_request(uint32_t ip);
+		void flush(buffer_list &held, const uint8_t *mac);
+		void reply(buffer &buf, arp_hdr &hdr, arp_ip &data);
 
 	public:
-		void recv(const slice &val);
+		explicit arp(device &dev) : dev(&dev), own(new arp_cache), cache(own.get()) {}
+		arp(device &dev, arp_cache &shared) : dev(&dev), cache(&shared) {}
+
+		/**
+		 * Receives the packet val, which lies within buf. Senders are merged
+		 * into the cache as RFC 826 describes, and a request for our address
+		 * is turned into the reply and sent back from buf.
+		 */
+		void recv(buffer &buf, const slice &val);
+		void tick(uint64_t now) { cache->expire(now); }
+
+		/**
+		 * Transmits the IPv4 packet in frame to the next hop ip, in host
+		 * order as the cache is keyed, holding it while the address is
+		 * resolved. The Ethernet header goes in the frame's headroom.
+		 * Returns false if the frame was dropped.
+		 */
+		bool send(buffer::unique_ptr frame, uint32_t ip);
 
 		void request(slice &val, uint32_t sip, const uint8_t *smac, uint32_t dip, const uint8_t *dmac);
-		const uint8_t *find_hwaddr(uint32_t ip, arphrd hwtype = ARPHRD_ETHER);
+		bool find_hwaddr(uint32_t ip, uint8_t *mac, arphrd hwtype = ARPHRD_ETHER) const;
+
+		const stats &get_stats() const { return st; }
 	};
 
 	static_assert(sizeof(arp_hdr) == UNET_ARP_HLEN, "arp_hdr size invalid");
 	static_assert(sizeof(arp_ip) == UNET_ARP_DLEN, "arp_ip size invalid");
+
+	/**
+	 * Formats the header into buf as snprintf does, for logs, with the
+	 * addresses that follow it when the protocol is IPv4.
+	 */
+	int arp_format(char *buf, size_t len, const arp_hdr &hdr);
 };
 
 fio::ostream &operator<<(fio::ostream &os, const unet::arp_hdr &v);
@@ -3,36 +3,158 @@
 
 #include <iostream>
 #include <cstddef>
+#include <cstdlib>
 
 #include "base.h"
 #include "ilist.h"
 #include "slice.h"
 
+#define UNET_HEADROOM       128  /* Octets to reserve for headers on TX */
+#define UNET_MAX_SEGS       16   /* Max. buffers chained into one packet */
+
 namespace unet
 {
+	class buffer;
+	class buffer_pool;
+
+	struct buffer_delete
+	{
+		void operator()(buffer *buf) const noexcept;
+	};
+
+	using buffer_list = ilist<buffer, buffer_delete>;
+
+	enum offload_flag : uint8_t
+	{
+		OFFLOAD_NEEDS_CSUM = 1, /* Checksum at csum_start+csum_offset is partial */
+		OFFLOAD_DATA_VALID = 2, /* Checksum was already verified */
+	};
+
+	enum gso_type : uint8_t
+	{
+		GSO_NONE  = 0,    /* Not a GSO frame */
+		GSO_TCPV4 = 1,    /* IPv4 TCP (TSO) */
+		GSO_UDP   = 3,    /* IPv4 UDP (UFO) */
+		GSO_TCPV6 = 4,    /* IPv6 TCP */
+		GSO_ECN   = 0x80, /* TCP has ECN set */
+	};
+
+	/**
+	 * Per-frame offload metadata. The layout matches the virtio-net header
+	 * so a device can move it in and out of the kernel without conversion.
+	 */
+	struct buffer_offload
+	{
+		uint8_t  flags = 0;
+		uint8_t  gso_type = GSO_NONE;
+		uint16_t hdr_len = 0;
+		uint16_t gso_size = 0;
+		uint16_t csum_start = 0;
+		uint16_t csum_offset = 0;
+
+		bool needs_csum() const { return flags & OFFLOAD_NEEDS_CSUM; }
+		bool csum_valid() const { return flags & (OFFLOAD_NEEDS_CSUM|OFFLOAD_DATA_VALID); }
+		bool is_gso() const { return (gso_type & ~GSO_ECN) != GSO_NONE; }
+
+		void set_csum(uint16_t start, uint16_t offset)
+		{
+			flags |= OFFLOAD_NEEDS_CSUM;
+			csum_start = start;
+			csum_offset = offset;
+		}
+
+		void set_gso(uint8_t type, uint16_t size, uint16_t hlen)
+		{
+			gso_type = type;
+			gso_size = size;
+			hdr_len = hlen;
+		}
+	};
+
+	/**
+	 * The data in a buffer is a window onto its storage, with headroom in
+	 * front and room to append behind. Headers are prepended with push and
+	 * stripped with pull, which only move the front of the window, so a
+	 * payload stays where it was first written while each layer wraps it.
+	 */
 	template <typename T>
 	class buffer_impl
 	{
+		unsigned int off = 0;
 		unsigned int len = 0;
 
 		T &as_buffer() { return *static_cast<T *>(this); }
 		const T &as_buffer() const { return *static_cast<const T *>(this); }
 
 	public:
+		uint8_t *data() { return as_buffer().head() + off; }
+		const uint8_t *data() const { return as_buffer().head() + off; }
+
 		unsigned int length() const { return len; }
-		unsigned int available() const { return as_buffer().size() - len; }
+		unsigned int headroom() const { return off; }
+		unsigned int available() const { return as_buffer().size() - off - len; }
+
+		/**
+		 * Empties the buffer and leaves n octets of headroom in front of
+		 * where its data will start.
+		 */
+		void reserve(unsigned int n)
+		{
+			off = std::min(n, as_buffer().size());
+			len = 0;
+		}
+
+		// Each returns the start of the octets it adds or the new start of
+		// the data, or nullptr and changes nothing if there isn't room.
 
-		void bump(unsigned int n) { len = std::min(len+n, as_buffer().size()); }
+		uint8_t *push(unsigned int n)
+		{
+			if (n > off) { return nullptr; }
+			off -= n;
+			len += n;
+			return data();
+		}
+
+		uint8_t *pull(unsigned int n)
+		{
+			if (n > len) { return nullptr; }
+			off += n;
+			len -= n;
+			return data();
+		}
+
+		uint8_t *put(unsigned int n)
+		{
+			if (n > available()) { return nullptr; }
+			uint8_t *at = data() + len;
+			len += n;
+			return at;
+		}
+
+		void bump(unsigned int n) { len += std::min(n, available()); }
+		void truncate(unsigned int n) { len = std::min(len, n); }
+
+		void reset()
+		{
+			off = 0;
+			len = 0;
+		}
 
-		slice begin() { return slice(as_buffer().data(), len); }
-		slice end() { return slice(as_buffer().data() + len, available()); }
+		slice begin() { return slice(data(), len); }
+		slice end() { return slice(data() + len, available()); }
 	};
 
 	class buffer :
-		public ilist<buffer>::entry, public buffer_impl<buffer>,
+		public buffer_list::entry, public buffer_impl<buffer>,
 		private nocopy, private nomove
 	{
+		friend class buffer_pool;
+		friend struct buffer_delete;
+
+		uint8_t *ptr;
+		buffer_pool *pool = nullptr;
 		unsigned int cap;
+		buffer_offload ol;
 		uint8_t buf[0];
 
 		void *operator new(size_t cap, unsigned int n)
@@ -40,14 +162,54 @@ namespace unet
 			return calloc(1, cap + n);
 		}
 
-		buffer(unsigned int n) : cap(n) {}
+		void *operator new(size_t, void *at) { return at; }
+		void operator delete(void *p) { free(p); }
+
+		buffer(unsigned int n) : ptr(buf), cap(n) {}
+		buffer(unsigned int n, buffer_pool *pool) : ptr(buf), pool(pool), cap(n) {}
 
 	public:
-		static buffer *create(unsigned int n) { return new(n) buffer(n); }
+		using unique_ptr = buffer_list::unique_ptr;
+
+		/**
+		 * Allocates a buffer for n octets of data, with headroom octets in
+		 * front of it for the headers that go out with it.
+		 */
+		static buffer *create(unsigned int n, unsigned int headroom = UNET_HEADROOM)
+		{
+			buffer *buf = new(n + headroom) buffer(n + headroom);
+			buf->reserve(headroom);
+			return buf;
+		}
 
 		unsigned int size() const { return cap; }
-		uint8_t *data() { return buf; }
-		const uint8_t *data() const { return buf; }
+		uint8_t *head() { return ptr; }
+		const uint8_t *head() const { return ptr; }
+
+		/**
+		 * Points the buffer at memory it does not own, such as a frame in a
+		 * device ring. The memory is only valid for as long as its owner
+		 * says so, so anything that needs to hold on to an external buffer
+		 * past the current burst must copy it first.
+		 */
+		void attach(uint8_t *data, unsigned int n)
+		{
+			buffer_impl<buffer>::reset();
+			ptr = data;
+			cap = n;
+		}
+
+		bool is_external() const { return ptr != buf; }
+		buffer_pool *owner() const { return pool; }
+
+		buffer_offload &offload() { return ol; }
+		const buffer_offload &offload() const { return ol; }
+
+		void reset()
+		{
+			buffer_impl<buffer>::reset();
+			ol = buffer_offload();
+		}
 	};
 
 	template <int N>
@@ -55,16 +217,16 @@ namespace unet
 		public ilist<static_buffer<N>>::entry, public buffer_impl<static_buffer<N>>, 
 		private nocopy, private nomove
 	{
-		unsigned int _pad;
 		uint8_t buf[N];
 
 	public:
 		unsigned int size() const { return N; }
-		uint8_t *data() { return buf; }
-		const uint8_t *data() const { return buf; }
+		uint8_t *head() { return buf; }
+		const uint8_t *head() const { return buf; }
 	};
 
-	static_assert(sizeof(buffer) == 24, "buffer size invalid");
+	static_assert(sizeof(buffer_offload) == 10, "buffer_offload size invalid");
+	static_assert(sizeof(buffer) == 56, "buffer size invalid");
 	static_assert(sizeof(static_buffer<0>) == 24, "static_buffer size invalid");
 	static_assert(sizeof(static_buffer<64>) == 88, "static_buffer size invalid");
 }
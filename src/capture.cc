@@ -0,0 +1,483 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/filter.h>
+
+using namespace unet;
+
+#define PCAPNG_SHB          0x0A0D0D0Au
+#define PCAPNG_IDB          0x00000001u
+#define PCAPNG_EPB          0x00000006u
+#define PCAPNG_MAGIC        0x1A2B3C4Du
+#define PCAPNG_LINK_ETHER   1
+#define PCAPNG_OPT_END      0
+#define PCAPNG_IF_TSRESOL   9
+#define PCAPNG_EPB_FLAGS    2
+
+#define CAPTURE_FLUSH       (256 * 1024)  /* octets buffered before a write */
+#define CAPTURE_IDLE_NS     1000000       /* writer sleep with nothing to do */
+
+static inline uint32_t get16(const uint8_t *p) { return (uint32_t)p[0] << 8 | p[1]; }
+static inline uint32_t get32(const uint8_t *p) { return get16(p) << 16 | get16(p + 2); }
+
+std::error_code capture_filter::load(const char *text)
+{
+	std::vector<insn> next;
+	char *end;
+
+	unsigned long n = strtoul(text, &end, 10);
+	if (end == text || n == 0 || n > UNET_CAPTURE_INSNS) {
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+	for (unsigned long i = 0; i < n; i++) {
+		unsigned long v[4];
+		for (auto &x : v) {
+			text = end;
+			x = strtoul(text, &end, 10);
+			if (end == text) { return std::make_error_code(std::errc::invalid_argument); }
+		}
+		if (v[0] > 0xffff || v[1] > 0xff || v[2] > 0xff || v[3] > 0xffffffff) {
+			return std::make_error_code(std::errc::invalid_argument);
+		}
+		next.push_back(insn{(uint16_t)v[0], (uint8_t)v[1], (uint8_t)v[2], (uint32_t)v[3]});
+	}
+
+	for (size_t pc = 0; pc < n; pc++) {
+		const insn &i = next[pc];
+		bool ok = true;
+		switch (BPF_CLASS(i.code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			switch (BPF_MODE(i.code)) {
+			case BPF_MEM: ok = i.k < BPF_MEMWORDS; break;
+			case BPF_IMM: case BPF_ABS: case BPF_IND: case BPF_LEN: break;
+			case BPF_MSH: ok = i.code == (BPF_LDX|BPF_B|BPF_MSH); break;
+			default: ok = false;
+			}
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			ok = i.k < BPF_MEMWORDS;
+			break;
+		case BPF_ALU:
+			ok = BPF_OP(i.code) <= BPF_XOR &&
+				!((BPF_OP(i.code) == BPF_DIV || BPF_OP(i.code) == BPF_MOD) &&
+						BPF_SRC(i.code) == BPF_K && i.k == 0);
+			break;
+		case BPF_JMP:
+			if (BPF_OP(i.code) == BPF_JA) { ok = i.k < n - pc - 1; }
+			else { ok = BPF_OP(i.code) <= BPF_JSET && i.jt < n - pc - 1 && i.jf < n - pc - 1; }
+			break;
+		case BPF_RET:
+		case BPF_MISC:
+			break;
+		}
+		if (!ok) { return std::make_error_code(std::errc::invalid_argument); }
+	}
+	if (BPF_CLASS(next[n - 1].code) != BPF_RET) {
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+
+	prog.swap(next);
+	return std::error_code();
+}
+
+std::error_code capture_filter::load_file(const char *path)
+{
+	int fd = ::open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) { return std::error_code(errno, std::system_category()); }
+
+	std::string text;
+	char buf[4096];
+	ssize_t n;
+	while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+		text.append(buf, n);
+	}
+	int err = n < 0 ? errno : 0;
+	::close(fd);
+	if (err) { return std::error_code(err, std::system_category()); }
+	return load(text.c_str());
+}
+
+unsigned int capture_filter::run(const uint8_t *pkt, unsigned int len) const
+{
+	uint32_t a = 0, x = 0, mem[BPF_MEMWORDS] = {};
+
+	for (size_t pc = 0; pc < prog.size(); pc++) {
+		const insn &i = prog[pc];
+		uint32_t k = i.k, off;
+
+		switch (i.code) {
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_B|BPF_ABS:
+		case BPF_LD|BPF_W|BPF_IND:
+		case BPF_LD|BPF_H|BPF_IND:
+		case BPF_LD|BPF_B|BPF_IND: {
+			unsigned int size = BPF_SIZE(i.code) == BPF_W ? 4 : BPF_SIZE(i.code) == BPF_H ? 2 : 1;
+			off = k;
+			if (BPF_MODE(i.code) == BPF_IND && __builtin_add_overflow(x, k, &off)) { return 0; }
+			if (off > len || len - off < size) { return 0; }
+			a = size == 4 ? get32(pkt + off) : size == 2 ? get16(pkt + off) : pkt[off];
+			break;
+		}
+		case BPF_LD|BPF_W|BPF_LEN:  a = len; break;
+		case BPF_LDX|BPF_W|BPF_LEN: x = len; break;
+		case BPF_LD|BPF_IMM:        a = k; break;
+		case BPF_LDX|BPF_IMM:       x = k; break;
+		case BPF_LD|BPF_MEM:        a = mem[k]; break;
+		case BPF_LDX|BPF_MEM:       x = mem[k]; break;
+		case BPF_LDX|BPF_B|BPF_MSH:
+			if (k >= len) { return 0; }
+			x = (pkt[k] & 0xf) << 2;
+			break;
+		case BPF_ST:                mem[k] = a; break;
+		case BPF_STX:               mem[k] = x; break;
+
+		case BPF_ALU|BPF_NEG:       a = -a; break;
+		case BPF_MISC|BPF_TAX:      x = a; break;
+		case BPF_MISC|BPF_TXA:      a = x; break;
+
+		case BPF_RET|BPF_K:         return k;
+		case BPF_RET|BPF_A:         return a;
+
+		case BPF_JMP|BPF_JA:        pc += k; break;
+
+		default:
+			if (BPF_CLASS(i.code) == BPF_ALU) {
+				uint32_t v = BPF_SRC(i.code) == BPF_X ? x : k;
+				switch (BPF_OP(i.code)) {
+				case BPF_ADD: a += v; break;
+				case BPF_SUB: a -= v; break;
+				case BPF_MUL: a *= v; break;
+				case BPF_DIV: if (v == 0) { return 0; } a /= v; break;
+				case BPF_MOD: if (v == 0) { return 0; } a %= v; break;
+				case BPF_OR:  a |= v; break;
+				case BPF_AND: a &= v; break;
+				case BPF_XOR: a ^= v; break;
+				case BPF_LSH: a = v < 32 ? a << v : 0; break;
+				case BPF_RSH: a = v < 32 ? a >> v : 0; break;
+				default: return 0;
+				}
+			}
+			else if (BPF_CLASS(i.code) == BPF_JMP) {
+				uint32_t v = BPF_SRC(i.code) == BPF_X ? x : k;
+				bool taken;
+				switch (BPF_OP(i.code)) {
+				case BPF_JEQ:  taken = a == v; break;
+				case BPF_JGT:  taken = a > v; break;
+				case BPF_JGE:  taken = a >= v; break;
+				case BPF_JSET: taken = (a & v) != 0; break;
+				default: return 0;
+				}
+				pc += taken ? i.jt : i.jf;
+			}
+			else {
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+capture_ring::capture_ring(const capture &owner, unsigned int id, size_t size) :
+	owner(owner),
+	id(id)
+{
+	size_t n = 4096;
+	while (n < size) { n <<= 1; }
+	mem.reset(new uint8_t[n]);
+	mask = n - 1;
+}
+
+capture_ring::record *capture_ring::reserve(unsigned int caplen, size_t &next)
+{
+	// Records are 8-aligned and never wrap: a record that won't fit before
+	// the end of the ring starts over at the beginning, and the reader
+	// skips the gap.
+	size_t need = (sizeof(record) + caplen + 7) & ~(size_t)7;
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	size_t off = h & mask;
+	size_t gap = mask + 1 - off;
+	size_t total = need > gap ? gap + need : need;
+	if (total > mask + 1 - (h - t)) {
+		drops++;
+		return nullptr;
+	}
+
+	if (need > gap) {
+		if (gap >= sizeof(record)) {
+			auto *skip = reinterpret_cast<record *>(&mem[off]);
+			skip->size = gap;
+			skip->dir = 0;
+		}
+		h += gap;
+		off = 0;
+	}
+
+	auto *r = reinterpret_cast<record *>(&mem[off]);
+	r->size = need;
+	next = h + need;
+	return r;
+}
+
+void capture_ring::commit(record *r, size_t next, capture_dir dir, unsigned int caplen, unsigned int len)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	r->caplen = caplen;
+	r->origlen = len;
+	r->dir = dir;
+	r->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	head.store(next, std::memory_order_release);
+}
+
+void capture_ring::push(capture_dir dir, const uint8_t *frame, unsigned int len)
+{
+	const capture_config &cfg = owner.cfg;
+	unsigned int caplen = cfg.filter.is_empty() ? len : cfg.filter.run(frame, len);
+	if (caplen == 0) { return; }
+	caplen = std::min(std::min(caplen, len), cfg.snaplen);
+
+	size_t next;
+	record *r = reserve(caplen, next);
+	if (r == nullptr) { return; }
+	memcpy(r + 1, frame, caplen);
+	commit(r, next, dir, caplen, len);
+}
+
+void capture_ring::push(capture_dir dir, buffer_list &pkt)
+{
+	if (pkt.is_singular()) {
+		push(dir, pkt.front());
+		return;
+	}
+
+	const capture_config &cfg = owner.cfg;
+	unsigned int len = 0;
+	for (auto &seg : pkt) { len += seg.length(); }
+	unsigned int caplen = std::min(len, cfg.snaplen);
+
+	// The filter needs the frame in one piece, so it runs on the copy,
+	// and sees only the part that fits the snap length.
+	size_t next;
+	record *r = reserve(caplen, next);
+	if (r == nullptr) { return; }
+
+	uint8_t *p = reinterpret_cast<uint8_t *>(r + 1);
+	unsigned int n = 0;
+	for (auto &seg : pkt) {
+		unsigned int m = std::min(seg.length(), caplen - n);
+		memcpy(p + n, seg.data(), m);
+		n += m;
+	}
+	if (!cfg.filter.is_empty()) {
+		caplen = std::min(caplen, cfg.filter.run(p, caplen));
+		if (caplen == 0) { return; }
+	}
+	commit(r, next, dir, caplen, len);
+}
+
+template <typename Fn>
+size_t capture_ring::drain(Fn fn)
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	size_t n = 0;
+
+	while (t != h) {
+		size_t off = t & mask;
+		size_t gap = mask + 1 - off;
+		if (gap < sizeof(record)) {
+			t += gap;
+			continue;
+		}
+		auto *r = reinterpret_cast<const record *>(&mem[off]);
+		if (r->dir != 0) {
+			fn(*r, reinterpret_cast<const uint8_t *>(r + 1));
+			n++;
+		}
+		t += r->size;
+	}
+	tail.store(t, std::memory_order_release);
+	return n;
+}
+
+capture::capture(const capture_config &cfg) : cfg(cfg)
+{
+	if (this->cfg.snaplen == 0) { this->cfg.snaplen = 262144; }
+	out.reserve(CAPTURE_FLUSH + 65536);
+}
+
+capture::~capture()
+{
+	stop();
+}
+
+capture_ring &capture::attach()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	rings.emplace_back(new capture_ring(*this, rings.size(), cfg.ring));
+	return *rings.back();
+}
+
+std::error_code capture::start()
+{
+	if (running.load()) { return std::error_code(); }
+
+	auto ec = open_next();
+	if (ec) { return ec; }
+
+	running.store(true);
+	writer = std::thread(&capture::run, this);
+	return std::error_code();
+}
+
+void capture::stop()
+{
+	if (running.exchange(false)) {
+		writer.join();
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+void capture::run()
+{
+	while (running.load(std::memory_order_relaxed)) {
+		if (!drain()) {
+			struct timespec ts = { 0, CAPTURE_IDLE_NS };
+			nanosleep(&ts, nullptr);
+		}
+	}
+	drain();
+	flush_out();
+}
+
+bool capture::drain()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	size_t total = 0;
+
+	for (auto &r : rings) {
+		total += r->drain([&](const capture_ring::record &rec, const uint8_t *data) {
+			if (cfg.rotate && written + out.size() >= cfg.rotate) {
+				flush_out();
+				open_next();
+			}
+			// Rings attached since the file began get described first.
+			for (; nrings < rings.size(); nrings++) {
+				write_interface();
+			}
+			write_packet(*r, rec, data);
+			if (out.size() >= CAPTURE_FLUSH) { flush_out(); }
+		});
+	}
+	if (total == 0) { flush_out(); }
+	return total > 0;
+}
+
+std::error_code capture::open_next()
+{
+	if (fd >= 0) { ::close(fd); }
+
+	std::string path = cfg.path;
+	if (cfg.rotate) {
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), ".%u", seq);
+		path += suffix;
+		seq = cfg.files ? (seq + 1) % cfg.files : seq + 1;
+	}
+
+	fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) { return std::error_code(errno, std::system_category()); }
+
+	written = 0;
+	nrings = 0;
+	write_header();
+	return std::error_code();
+}
+
+std::error_code capture::flush_out()
+{
+	size_t n = 0;
+	while (fd >= 0 && n < out.size()) {
+		ssize_t rc = ::write(fd, out.data() + n, out.size() - n);
+		if (rc < 0) {
+			if (errno == EINTR) { continue; }
+			// Keep going without a file rather than stall the rings.
+			int err = errno;
+			::close(fd);
+			fd = -1;
+			out.clear();
+			return std::error_code(err, std::system_category());
+		}
+		n += rc;
+	}
+	written += out.size();
+	out.clear();
+	return std::error_code();
+}
+
+template <typename T>
+static inline void put(std::vector<uint8_t> &out, T val)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(&val);
+	out.insert(out.end(), p, p + sizeof(val));
+}
+
+void capture::write_header()
+{
+	put<uint32_t>(out, PCAPNG_SHB);
+	put<uint32_t>(out, 28);
+	put<uint32_t>(out, PCAPNG_MAGIC);
+	put<uint16_t>(out, 1);
+	put<uint16_t>(out, 0);
+	put<int64_t>(out, -1);
+	put<uint32_t>(out, 28);
+}
+
+void capture::write_interface()
+{
+	put<uint32_t>(out, PCAPNG_IDB);
+	put<uint32_t>(out, 32);
+	put<uint16_t>(out, PCAPNG_LINK_ETHER);
+	put<uint16_t>(out, 0);
+	put<uint32_t>(out, cfg.snaplen);
+	put<uint16_t>(out, PCAPNG_IF_TSRESOL);
+	put<uint16_t>(out, 1);
+	put<uint32_t>(out, 9);          /* 10^-9, then padding */
+	put<uint32_t>(out, PCAPNG_OPT_END);
+	put<uint32_t>(out, 32);
+}
+
+void capture::write_packet(const capture_ring &r, const capture_ring::record &rec, const uint8_t *data)
+{
+	uint32_t pad = (4 - rec.caplen % 4) % 4;
+	uint32_t size = 32 + rec.caplen + pad + 12;
+
+	put<uint32_t>(out, PCAPNG_EPB);
+	put<uint32_t>(out, size);
+	put<uint32_t>(out, r.id);
+	put<uint32_t>(out, rec.ts >> 32);
+	put<uint32_t>(out, rec.ts);
+	put<uint32_t>(out, rec.caplen);
+	put<uint32_t>(out, rec.origlen);
+	out.insert(out.end(), data, data + rec.caplen);
+	out.insert(out.end(), pad, 0);
+	put<uint16_t>(out, PCAPNG_EPB_FLAGS);
+	put<uint16_t>(out, 4);
+	put<uint32_t>(out, rec.dir == CAPTURE_RX ? 1 : 2);
+	put<uint32_t>(out, PCAPNG_OPT_END);
+	put<uint32_t>(out, size);
+}
@@ -0,0 +1,168 @@
+#ifndef UNET_CAPTURE_H
+#define UNET_CAPTURE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <system_error>
+#include <cstddef>
+#include <cstdint>
+
+#include "base.h"
+#include "buffer.h"
+
+#define UNET_CAPTURE_INSNS  4096 /* Max. instructions in a filter program */
+
+namespace unet
+{
+	enum capture_dir : uint8_t
+	{
+		CAPTURE_RX = 1,
+		CAPTURE_TX = 2,
+	};
+
+	/**
+	 * Classic BPF program, loaded from the numeric listing tcpdump prints
+	 * with -ddd, so any tcpdump expression can be used as a filter:
+	 *
+	 *     tcpdump -ddd -y EN10MB 'icmp or arp' > filter.bpf
+	 *
+	 * The program is checked when loaded the way the kernel checks socket
+	 * filters: jumps go forward and stay in range, scratch memory indices
+	 * are valid, there is no constant division by zero, and every path
+	 * ends in a return. Loads past the end of the frame return 0.
+	 */
+	class capture_filter
+	{
+		struct insn
+		{
+			uint16_t code;
+			uint8_t  jt;
+			uint8_t  jf;
+			uint32_t k;
+		};
+
+		std::vector<insn> prog;
+
+	public:
+		std::error_code load(const char *text);
+		std::error_code load_file(const char *path);
+
+		bool is_empty() const { return prog.empty(); }
+
+		/**
+		 * Runs the program on the frame. Returns how many octets of it to
+		 * capture, 0 to skip it.
+		 */
+		unsigned int run(const uint8_t *pkt, unsigned int len) const;
+	};
+
+	struct capture_config
+	{
+		std::string path;                 /* pcapng file, or prefix with files */
+		unsigned int snaplen = 262144;    /* octets kept per frame */
+		size_t ring = 4 << 20;            /* octets of ring per device */
+		size_t rotate = 0;                /* octets per file before the next, 0 for one file */
+		unsigned int files = 0;           /* files to cycle through, 0 for no limit */
+		capture_filter filter;
+	};
+
+	class capture;
+
+	/**
+	 * Single-producer ring between one device thread and the writer. The
+	 * producer copies the captured part of a frame in behind a record
+	 * header; nothing is ever waited on, and a frame that doesn't fit is
+	 * counted and dropped.
+	 */
+	class capture_ring : private nocopy, private nomove
+	{
+		friend class capture;
+
+		struct record
+		{
+			uint32_t size;       /* octets to the next record */
+			uint32_t caplen;     /* octets of frame that follow */
+			uint32_t origlen;
+			uint8_t  dir;        /* capture_dir, 0 to skip to the ring start */
+			uint8_t  _pad[3];
+			uint64_t ts;         /* ns since the epoch */
+		};
+
+		const capture &owner;
+		unsigned int id;
+		std::unique_ptr<uint8_t[]> mem;
+		size_t mask;
+
+		// Kept a cache line apart so producer and writer don't share one.
+		std::atomic<size_t> head{0};   /* written by the producer */
+		size_t drops = 0;
+		uint8_t _pad[64];
+		std::atomic<size_t> tail{0};   /* written by the writer */
+
+		capture_ring(const capture &owner, unsigned int id, size_t size);
+
+		record *reserve(unsigned int caplen, size_t &next);
+		void commit(record *r, size_t next, capture_dir dir, unsigned int caplen, unsigned int len);
+
+		template <typename Fn>
+		size_t drain(Fn fn);
+
+	public:
+		void push(capture_dir dir, const uint8_t *frame, unsigned int len);
+		void push(capture_dir dir, buffer &buf) { push(dir, buf.data(), buf.length()); }
+		void push(capture_dir dir, buffer_list &pkt);
+
+		size_t dropped() const { return drops; }
+	};
+
+	/**
+	 * Writes frames captured on any number of devices to pcapng files
+	 * from a background thread, one interface per device, with nanosecond
+	 * timestamps and the direction of each frame. Files are rotated by
+	 * size, cycling through a fixed number of them if asked.
+	 */
+	class capture : private nocopy, private nomove
+	{
+		friend class capture_ring;
+
+		capture_config cfg;
+		std::vector<std::unique_ptr<capture_ring>> rings;
+		std::mutex lock;
+		std::thread writer;
+		std::atomic<bool> running{false};
+
+		int fd = -1;
+		unsigned int seq = 0;
+		size_t written = 0;
+		size_t nrings = 0;     /* interfaces described in the current file */
+		std::vector<uint8_t> out;
+
+		void run();
+		bool drain();
+		std::error_code open_next();
+		std::error_code flush_out();
+		void write_header();
+		void write_interface();
+		void write_packet(const capture_ring &r, const capture_ring::record &rec, const uint8_t *data);
+
+	public:
+		explicit capture(const capture_config &cfg);
+		~capture();
+
+		std::error_code start();
+		void stop();
+
+		/**
+		 * Returns a new ring for one device to push frames onto. Rings can
+		 * be added while the capture runs but live as long as it does.
+		 */
+		capture_ring &attach();
+	};
+}
+
+#endif
+
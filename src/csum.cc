@@ -0,0 +1,197 @@
+#include "csum.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+# define UNET_CSUM_X86 1
+# include <immintrin.h>
+#endif
+
+using namespace unet;
+
+using kernel_fn = uint64_t (*)(const uint8_t *p, size_t n, uint64_t sum);
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Adds the last 0-3 octets. A lone final octet is the first half of a
+// 16-bit word, which in memory order is its low half on little endian.
+static inline uint64_t sum_tail(const uint8_t *p, size_t n, uint64_t sum)
+{
+	if (n & 2) {
+		uint16_t v;
+		memcpy(&v, p, sizeof(v));
+		sum += v;
+		p += 2;
+	}
+	if (n & 1) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		sum += *p;
+#else
+		sum += (uint32_t)*p << 8;
+#endif
+	}
+	return sum;
+}
+
+static uint64_t sum_scalar(const uint8_t *p, size_t n, uint64_t sum)
+{
+	// Independent accumulators keep the adds from serializing.
+	uint64_t a = 0, b = 0, c = 0, d = 0;
+	for (; n >= 16; p += 16, n -= 16) {
+		a += load32(p);
+		b += load32(p + 4);
+		c += load32(p + 8);
+		d += load32(p + 12);
+	}
+	sum += a + b + c + d;
+	for (; n >= 4; p += 4, n -= 4) {
+		sum += load32(p);
+	}
+	return sum_tail(p, n, sum);
+}
+
+#ifdef UNET_CSUM_X86
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *p, size_t n, uint64_t sum)
+{
+	// Widen each 32-bit lane into a 64-bit accumulator, which can't
+	// overflow for any buffer that fits in memory.
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero;
+	for (; n >= 32; p += 32, n -= 32) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(x, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(x, zero));
+		a = _mm_add_epi64(a, _mm_unpacklo_epi32(y, zero));
+		b = _mm_add_epi64(b, _mm_unpackhi_epi32(y, zero));
+	}
+	a = _mm_add_epi64(a, b);
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), a);
+	return sum_scalar(p, n, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *p, size_t n, uint64_t sum)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = zero, b = zero, c = zero, d = zero;
+	for (; n >= 64; p += 64, n -= 64) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(x, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(x, zero));
+		c = _mm256_add_epi64(c, _mm256_unpacklo_epi32(y, zero));
+		d = _mm256_add_epi64(d, _mm256_unpackhi_epi32(y, zero));
+	}
+	if (n >= 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(x, zero));
+		b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(x, zero));
+		p += 32;
+		n -= 32;
+	}
+	if (n >= 16) {
+		__m256i x = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+		c = _mm256_add_epi64(c, x);
+		p += 16;
+		n -= 16;
+	}
+	a = _mm256_add_epi64(_mm256_add_epi64(a, b), _mm256_add_epi64(c, d));
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), a);
+
+	// GCC leaves this out before the tail call, and the scalar tail then
+	// pays the AVX to SSE transition penalty.
+	_mm256_zeroupper();
+	return sum_scalar(p, n, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+#endif
+
+static kernel_fn kernel_of(csum_kernel k)
+{
+	switch (k) {
+	case CSUM_SCALAR: return sum_scalar;
+#ifdef UNET_CSUM_X86
+	case CSUM_SSE2: return sum_sse2;
+	case CSUM_AVX2: return sum_avx2;
+#else
+	case CSUM_SSE2: break;
+	case CSUM_AVX2: break;
+#endif
+	}
+	return sum_scalar;
+}
+
+static csum_kernel select_kernel()
+{
+#ifdef UNET_CSUM_X86
+	// This runs during static initialization, possibly ahead of libgcc's.
+	__builtin_cpu_init();
+#endif
+	if (csum_supported(CSUM_AVX2)) { return CSUM_AVX2; }
+	if (csum_supported(CSUM_SSE2)) { return CSUM_SSE2; }
+	return CSUM_SCALAR;
+}
+
+static const csum_kernel active = select_kernel();
+static const kernel_fn active_fn = kernel_of(active);
+
+static inline uint32_t fold64(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return static_cast<uint32_t>(sum);
+}
+
+const char *unet::csum_kernel_name(csum_kernel k)
+{
+	switch (k) {
+#define X(name) case CSUM_##name: return #name;
+		UNET_CSUM_KERNEL
+#undef X
+	}
+	return "(unknown)";
+}
+
+bool unet::csum_supported(csum_kernel k)
+{
+	switch (k) {
+	case CSUM_SCALAR: return true;
+#ifdef UNET_CSUM_X86
+	case CSUM_SSE2: return __builtin_cpu_supports("sse2");
+	case CSUM_AVX2: return __builtin_cpu_supports("avx2");
+#else
+	case CSUM_SSE2: return false;
+	case CSUM_AVX2: return false;
+#endif
+	}
+	return false;
+}
+
+csum_kernel unet::csum_active()
+{
+	return active;
+}
+
+uint32_t unet::csum_partial(const void *data, size_t n, uint32_t sum)
+{
+	return fold64(active_fn(static_cast<const uint8_t *>(data), n, sum));
+}
+
+uint32_t unet::csum_partial(csum_kernel k, const void *data, size_t n, uint32_t sum)
+{
+	if (!csum_supported(k)) { k = CSUM_SCALAR; }
+	return fold64(kernel_of(k)(static_cast<const uint8_t *>(data), n, sum));
+}
+
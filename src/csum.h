@@ -0,0 +1,87 @@
+#ifndef UNET_CSUM_H
+#define UNET_CSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define UNET_CSUM_KERNEL \
+	X(SCALAR) /* Portable 32-bit word sum */ \
+	X(SSE2)   /* 128-bit vector sum */ \
+	X(AVX2)   /* 256-bit vector sum */ \
+
+namespace unet
+{
+	enum csum_kernel
+	{
+#define X(name) CSUM_##name,
+		UNET_CSUM_KERNEL
+#undef X
+	};
+
+	const char *csum_kernel_name(csum_kernel k);
+	bool csum_supported(csum_kernel k);
+
+	/**
+	 * The kernel csum_partial uses, the widest one the CPU supports.
+	 */
+	csum_kernel csum_active();
+
+	/**
+	 * Adds n octets to a running ones-complement sum. Values are in memory
+	 * order throughout, so a folded result is stored as is. Sums may be
+	 * chained across calls as long as every call but the last has an even
+	 * length.
+	 */
+	uint32_t csum_partial(const void *data, size_t n, uint32_t sum = 0);
+	uint32_t csum_partial(csum_kernel k, const void *data, size_t n, uint32_t sum = 0);
+
+	inline uint16_t csum_fold(uint32_t sum)
+	{
+		sum = (sum & 0xffff) + (sum >> 16);
+		sum = (sum & 0xffff) + (sum >> 16);
+		return static_cast<uint16_t>(~sum);
+	}
+
+	inline uint16_t csum(const void *data, size_t n)
+	{
+		return csum_fold(csum_partial(data, n));
+	}
+
+	/**
+	 * Partial sum of the IPv4 pseudo-header for TCP and UDP. Addresses are
+	 * in network order, len in host order.
+	 */
+	inline uint32_t csum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t len)
+	{
+		uint64_t sum = (uint64_t)saddr + daddr;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		sum += (uint32_t)(proto + len) << 8;
+#else
+		sum += (uint32_t)proto + len;
+#endif
+		sum = (sum & 0xffffffff) + (sum >> 32);
+		return static_cast<uint32_t>((sum & 0xffffffff) + (sum >> 32));
+	}
+
+	/**
+	 * Incremental updates after rewriting a 16 or 32-bit field covered by
+	 * check, per RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). All values are in
+	 * memory order.
+	 */
+	inline uint16_t csum_replace2(uint16_t check, uint16_t from, uint16_t to)
+	{
+		uint32_t sum = (uint16_t)~check + (uint32_t)(uint16_t)~from + to;
+		return csum_fold(sum);
+	}
+
+	inline uint16_t csum_replace4(uint16_t check, uint32_t from, uint32_t to)
+	{
+		uint64_t sum = (uint16_t)~check + (uint64_t)~from + to;
+		sum = (sum & 0xffffffff) + (sum >> 32);
+		sum = (sum & 0xffffffff) + (sum >> 32);
+		return csum_fold(static_cast<uint32_t>(sum));
+	}
+}
+
+#endif
+
@@ -1,31 +1,197 @@
 #include "device.h"
+#include "pool.h"
 #include "fmt.h"
+#include "timer.h"
+#include "capture.h"
+#include "log.h"
+
+#include <poll.h>
+#include <time.h>
 
 using namespace unet;
 
-std::error_code device::loop_rx(eth &recvr)
+static inline uint64_t clock_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline unsigned int tx_bucket(unsigned int n)
+{
+	unsigned int b = n ? 32 - __builtin_clz(n) : 0;
+	return b < UNET_TX_HIST ? b : UNET_TX_HIST - 1;
+}
+
+std::error_code device::wait_rx()
 {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	while (::poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR) { return std::error_code(errno, std::system_category()); }
+	}
+	return std::error_code();
+}
+
+std::error_code device::loop_rx(eth &recvr, buffer_pool &pool, unsigned int burst)
+{
+	buffer_cache cache(pool, burst);
+	buffer_list frames;
 	for (;;) {
-		auto *buf = unet::buffer::create(2024);
-		auto ec = read(*buf);
+		auto ec = read_burst(frames, pool, burst);
 		if (ec) {
-			delete buf;
+			rxst->errors++;
 			return ec;
 		}
-		recvr.recv(buf->begin());
-		delete buf;
+		rxst->bursts++;
+		for (auto &buf : frames) {
+			if (__builtin_expect(cap != nullptr, 0)) { cap->push(CAPTURE_RX, buf); }
+			rxst->frames++;
+		}
+		if (__builtin_expect(trc != nullptr, 0)) {
+			trc->recv_burst(recvr, frames, trace_clock());
+		}
+		else {
+			recvr.recv_burst(frames);
+		}
+		frames.clear();
+
+		// Timers only move between bursts, so they can run late on an
+		// idle device but never early.
+		recvr.tick(coarse_clock_ms());
+
+		// Whatever the burst sent goes to the kernel in one submission.
+		if (__builtin_expect(trc != nullptr, 0)) {
+			trc->flush_burst(*this);
+		}
+		else {
+			flush();
+		}
 	}
 }
 
+eth_hdr *device::push_header(buffer &buf, const uint8_t *dmac, eth_type type)
+{
+	uint8_t *p = buf.push(UNET_ETH_HLEN + tags_len);
+	if (p == nullptr) {
+		txst->errors++;
+		errno = ENOBUFS;
+		return nullptr;
+	}
+
+	auto *hdr = reinterpret_cast<eth_hdr *>(p);
+	memcpy(hdr->dmac, dmac, sizeof(hdr->dmac));
+	memcpy(hdr->smac, hw, sizeof(hdr->smac));
+	if (tags_len) {
+		memcpy(&hdr->_type, tags, tags_len);
+	}
+	uint16_t val = hton16(type);
+	memcpy(p + UNET_ETH_HLEN + tags_len - sizeof(val), &val, sizeof(val));
+	return hdr;
+}
+
 ssize_t device::transmit(buffer &buf, const uint8_t *dmac, eth_type type)
 {
-	slice val = buf.begin();
-	eth_hdr &hdr = val.as<eth_hdr>();
+	eth_hdr *hdr = push_header(buf, dmac, type);
+	if (hdr == nullptr) { return -1; }
+	log_event(LOG_ETH_TX, hdr, UNET_ETH_HLEN);
 
-	memcpy(hdr.dmac, dmac, sizeof(hdr.dmac));
-	memcpy(hdr.smac, hw, sizeof(hdr.smac));
-	hdr.set_type(type);
+	if (__builtin_expect(cap != nullptr, 0)) { cap->push(CAPTURE_TX, buf); }
+	uint64_t t = trace_start();
+	ssize_t n = write(buf.begin(), buf.offload());
+	trace_stop(TRACE_TX, t);
+	if (n >= 0) { queued(); }
+	else { failed(); }
+	return n;
+}
 
-	return write(val);
+ssize_t device::transmit(buffer_list &pkt, const uint8_t *dmac, eth_type type)
+{
+	if (pkt.is_empty()) {
+		txst->errors++;
+		errno = EINVAL;
+		return -1;
+	}
+
+	buffer &first = pkt.front();
+	eth_hdr *hdr = push_header(first, dmac, type);
+	if (hdr == nullptr) { return -1; }
+	log_event(LOG_ETH_TX, hdr, UNET_ETH_HLEN);
+
+	if (__builtin_expect(cap != nullptr, 0)) { cap->push(CAPTURE_TX, pkt); }
+
+	// The device may take the segments, so the offload goes by copy.
+	buffer_offload ol = first.offload();
+	uint64_t t = trace_start();
+	ssize_t n = write(pkt, ol);
+	trace_stop(TRACE_TX, t);
+	if (n >= 0) { queued(); }
+	else { failed(); }
+	return n;
+}
+
+void device::queued()
+{
+	if (tx_owner) {
+		tx_owner->queued();
+		return;
+	}
+
+	uint64_t now = txcfg.latency_us ? clock_us() : 0;
+	if (tx_pending++ == 0) { tx_first = now; }
+	txst->frames++;
+	txst->depth[tx_bucket(tx_pending)]++;
+
+	if (tx_pending >= txcfg.batch) {
+		txst->full++;
+		flush();
+	}
+	else if (txcfg.latency_us && now - tx_first >= txcfg.latency_us) {
+		txst->late++;
+		flush();
+	}
+}
+
+void device::failed()
+{
+	// A queue that stays full under load drops frames, which says nothing
+	// is wrong with the device.
+	if (errno == ENOBUFS || errno == EAGAIN) { txst->dropped++; }
+	else { txst->errors++; }
 }
 
+std::error_code device::flush()
+{
+	if (tx_pending) {
+		txst->flushes++;
+		txst->batch[tx_bucket(tx_pending)]++;
+		tx_pending = 0;
+	}
+	return submit_tx();
+}
+
+
+void device::collect(counter_set &out) const
+{
+	rx_drops += rx_dropped();
+
+	out.add("device.rx_bursts", rxst->bursts);
+	out.add("device.rx_frames", rxst->frames);
+	out.add("device.rx_drops", rx_drops);
+	out.add("device.rx_errors", rxst->errors);
+	out.add("device.tx_frames", txst->frames);
+	out.add("device.tx_flushes", txst->flushes);
+	out.add("device.tx_full", txst->full);
+	out.add("device.tx_late", txst->late);
+	out.add("device.tx_dropped", txst->dropped);
+	out.add("device.tx_errors", txst->errors);
+
+	for (unsigned int i = 0; i < UNET_TX_HIST; i++) {
+		out.add("device.tx_depth." + std::to_string(i ? 1u << (i - 1) : 0), txst->depth[i]);
+	}
+	for (unsigned int i = 0; i < UNET_TX_HIST; i++) {
+		out.add("device.tx_batch." + std::to_string(i ? 1u << (i - 1) : 0), txst->batch[i]);
+	}
+	if (cap) {
+		out.add("capture.dropped", cap->dropped());
+	}
+}
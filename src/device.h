@@ -12,16 +12,81 @@
 #include "eth.h"
 #include "ip.h"
 #include "arp.h"
+#include "stats.h"
+#include "trace.h"
+
+#define UNET_RX_BURST       32   /* Default frames per RX loop iteration. */
+#define UNET_GSO_FRAME_LEN  65550 /* Max. octets in a GSO super-frame */
+#define UNET_TX_HIST        16   /* log2 buckets in the TX histograms */
 
 namespace unet
 {
+	class buffer_pool;
+	class capture_ring;
+
+	enum device_flag : unsigned int
+	{
+		DEVICE_MULTI_QUEUE = 1u << 0, /* Let more queues attach to the interface */
+		DEVICE_VNET_HDR    = 1u << 1, /* Exchange checksum and GSO offload metadata */
+		DEVICE_IO_URING    = 1u << 2, /* Drive frame I/O through io_uring */
+	};
+
+	struct tx_config
+	{
+		unsigned int batch = UNET_RX_BURST; /* frames queued before a flush */
+		uint64_t latency_us = 100;          /* age of the oldest queued frame before a flush, 0 for none */
+	};
+
+	/**
+	 * Histogram bucket n counts values from 2^(n-1) up to 2^n - 1, and
+	 * bucket 0 counts zeros. The last bucket takes everything above.
+	 */
+	struct tx_stats
+	{
+		size_t frames;                  /* frames queued by transmit */
+		size_t flushes;                 /* flushes that sent something */
+		size_t full;                    /* flushes forced by the batch size */
+		size_t late;                    /* flushes forced by the latency limit */
+		size_t dropped;                 /* frames dropped with the device's queue full */
+		size_t errors;                  /* frames that failed to queue otherwise */
+		size_t depth[UNET_TX_HIST];     /* queue depth after each transmit */
+		size_t batch[UNET_TX_HIST];     /* frames per flush */
+	};
+
+	struct rx_stats
+	{
+		size_t bursts;                  /* non-empty reads by loop_rx */
+		size_t frames;                  /* frames those reads returned */
+		size_t errors;                  /* read errors that ended loop_rx */
+	};
+
 	class device : private nocopy
 	{
+		tx_config txcfg;
+		padded<tx_stats> txst;
+		padded<rx_stats> rxst;
+		mutable size_t rx_drops = 0;    /* rx_dropped summed by collect */
+		unsigned int tx_pending = 0;
+		uint64_t tx_first = 0;
+		device *tx_owner = nullptr;
+		capture_ring *cap = nullptr;
+		tracer *trc = nullptr;
+
+		eth_hdr *push_header(buffer &buf, const uint8_t *dmac, eth_type type);
+		void queued();
+		void failed();
+
+	protected:
 		std::string name;
 		int fd = -1;
+		unsigned int flags = 0;
 		uint32_t addr = 0;
-		uint8_t hw[6];
-		unet::arp arp;
+		uint8_t hw[6] = {};
+
+		// VLAN tags put between the addresses and the type of every frame
+		// sent, outermost first, as they go on the wire.
+		uint8_t tags[UNET_VLAN_MAXTAGS * UNET_VLAN_HLEN] = {};
+		unsigned int tags_len = 0;
 
 		void move(device &src)
 		{
@@ -29,31 +94,123 @@ namespace unet
 
 			if (fd >= 0) { ::close(fd); }
 			fd = src.fd;
+			flags = src.flags;
 			addr = src.addr;
 			memcpy(hw, src.hw, sizeof(hw));
+			memcpy(tags, src.tags, sizeof(tags));
+			tags_len = src.tags_len;
+
+			txcfg = src.txcfg;
 
 			src.fd = -1;
+			src.flags = 0;
 			src.addr = 0;
 			memset(src.hw, 0, sizeof(src.hw));
+			src.tags_len = 0;
+		}
+
+		void reset()
+		{
+			if (fd >= 0) {
+				while (::close(fd) < 0 && errno == EINTR) {}
+			}
+			name.clear();
+			fd = -1;
+			flags = 0;
+			addr = 0;
+			memset(hw, 0, sizeof(hw));
+			tags_len = 0;
 		}
 
+		std::error_code wait_rx();
+
+		/**
+		 * Queues the frames this device sends in owner's batch, so they
+		 * count toward its batch size and latency limit and go out with
+		 * its flush, for devices that write through another.
+		 */
+		void queue_with(device &owner) { tx_owner = &owner; }
+
+		/**
+		 * Hands the frames written since the last call to the kernel, for
+		 * backends that can defer that to send a batch at once.
+		 */
+		virtual std::error_code submit_tx() { return std::error_code(); }
+
+		/**
+		 * Frames dropped before they could be read since the last call,
+		 * for backends whose kernel side counts them. Only collect calls
+		 * it, from whichever thread takes the snapshot.
+		 */
+		virtual size_t rx_dropped() const { return 0; }
+
 	public:
-		device() {}
-		~device() { close(); }
+		virtual ~device() {}
+
+		virtual void close() = 0;
 
-		device(device &&src) { move(src); }
-		device &operator=(device &&src) { move(src); return *this; }
+		/**
+		 * Reads up to max frames onto the end of list, blocking until at
+		 * least one is available. Frames are either copied into buffers from
+		 * pool or attached to memory owned by the device, which stays valid
+		 * until the next read on the device.
+		 */
+		virtual std::error_code read_burst(buffer_list &list, buffer_pool &pool, unsigned int max) = 0;
+		virtual std::error_code read(buffer &buf) = 0;
+		virtual ssize_t write(const slice &buf, const buffer_offload &ol) = 0;
 
-		std::error_code open(const char *addr, const char *route, const char *hwaddr, const char *name = "");
-		void close();
+		/**
+		 * Writes one frame gathered from the segments in pkt, up to
+		 * UNET_MAX_SEGS of them. A device that has to keep segments until
+		 * the write completes takes them off pkt; the rest stay with the
+		 * caller.
+		 */
+		virtual ssize_t write(buffer_list &pkt, const buffer_offload &ol) = 0;
 
-		std::error_code loop_rx(eth &recvr);
-		std::error_code read(buffer &buf);
-		ssize_t write(const slice &buf);
+		ssize_t write(const slice &buf) { return write(buf, buffer_offload()); }
 
+		std::error_code loop_rx(eth &recvr, buffer_pool &pool, unsigned int burst = UNET_RX_BURST);
+
+		/**
+		 * Prepends an Ethernet header to the packet in buf, or the first
+		 * segment of pkt, with the device's VLAN tags if it has any, and
+		 * queues the frame. Fails with ENOBUFS if there
+		 * isn't the headroom. The frame is copied or taken by the time this
+		 * returns, but may not reach the kernel until the next flush, which
+		 * loop_rx does after every burst and transmit does itself once the
+		 * batch size or latency limit is reached.
+		 */
 		ssize_t transmit(buffer &buf, const uint8_t *dmac, eth_type type);
+		ssize_t transmit(buffer_list &pkt, const uint8_t *dmac, eth_type type);
+		std::error_code flush();
+
+		void set_tx_config(const tx_config &cfg) { txcfg = cfg; }
+
+		/**
+		 * Copies frames received by loop_rx and sent by transmit onto ring,
+		 * or stops if it is null. Set it before the device's thread starts.
+		 */
+		void set_capture(capture_ring *ring) { cap = ring; }
+
+		/**
+		 * Times a sample of the frames received by loop_rx with t, or
+		 * stops if it is null. Set it before the device's thread starts.
+		 */
+		void set_tracer(tracer *t) { trc = t; }
+		const tx_stats &get_tx_stats() const { return *txst; }
+		const rx_stats &get_rx_stats() const { return *rxst; }
+
+		/**
+		 * Adds the device counters to out, with a counter per bucket of the
+		 * TX histograms named by the bucket's lower bound, as in
+		 * device.tx_batch.8 for flushes of 8 to 15 frames.
+		 */
+		void collect(counter_set &out) const;
 
+		const std::string &ifname() const { return name; }
+		uint32_t ipaddr() const { return addr; }
 		const uint8_t *hwaddr() const { return hw; }
+		bool has_offload() const { return flags & DEVICE_VNET_HDR; }
 	};
 }
 
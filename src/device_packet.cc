@@ -0,0 +1,363 @@
+#include "device_packet.h"
+#include "pool.h"
+#include "fmt.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+using namespace unet;
+
+// Offset of frame data in a TX slot when PACKET_TX_HAS_OFF is not used.
+#define TX_DATA_OFF (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+static inline struct tpacket_block_desc *
+ring_block(uint8_t *map, const packet_ring_config &cfg, unsigned int idx)
+{
+	return reinterpret_cast<struct tpacket_block_desc *>(map + (size_t)idx * cfg.block_size);
+}
+
+static int setopt(int s, int opt, const void *val, socklen_t len)
+{
+	return setsockopt(s, SOL_PACKET, opt, val, len);
+}
+
+std::error_code packet_device::open(const char *ifname, const char *a, const char *hwa, const packet_ring_config &c)
+{
+	uint32_t new_addr = 0;
+	uint8_t new_hwaddr[6];
+	struct ifreq ifr;
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	struct packet_mreq mr;
+	struct timeval tv;
+	size_t rx_len = 0, tx_len = 0;
+	void *m = MAP_FAILED;
+	int s = -1, v;
+	std::error_code ec;
+
+	if (inet_pton(AF_INET, a, &new_addr) != 1) {
+		ec = error::invalid_ipaddr;
+		goto done;
+	}
+
+	if (hwa && sscanf(hwa, UNET_MAC_FMT, UNET_MAC_ARG(&new_hwaddr)) != UNET_MAC_NARG) {
+		ec = error::invalid_hwaddr;
+		goto done;
+	}
+
+	if ((s = socket(AF_PACKET, SOCK_RAW, hton16(ETH_P_ALL))) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+	if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = hton16(ETH_P_ALL);
+	sll.sll_ifindex = ifr.ifr_ifindex;
+
+	if (hwa == nullptr) {
+		if (ioctl(s, SIOCGIFHWADDR, &ifr) < 0) {
+			ec = std::error_code(errno, std::system_category());
+			goto done;
+		}
+		memcpy(new_hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(new_hwaddr));
+	}
+	else {
+		// Our address is not the interface's, so its frames must be let in.
+		memset(&mr, 0, sizeof(mr));
+		mr.mr_ifindex = sll.sll_ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+		if (setopt(s, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+			ec = std::error_code(errno, std::system_category());
+			goto done;
+		}
+	}
+
+	v = TPACKET_V3;
+	if (setopt(s, PACKET_VERSION, &v, sizeof(v)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = c.block_size;
+	req.tp_block_nr = c.rx_blocks;
+	req.tp_frame_size = c.frame_size;
+	req.tp_frame_nr = (c.block_size / c.frame_size) * c.rx_blocks;
+	req.tp_retire_blk_tov = c.timeout_ms;
+	if (setopt(s, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	// The TX ring is frame based even in V3 and rejects the block options.
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = c.block_size;
+	req.tp_block_nr = c.tx_blocks;
+	req.tp_frame_size = c.frame_size;
+	req.tp_frame_nr = (c.block_size / c.frame_size) * c.tx_blocks;
+	if (setopt(s, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	rx_len = (size_t)c.block_size * c.rx_blocks;
+	tx_len = (size_t)c.block_size * c.tx_blocks;
+	m = mmap(nullptr, rx_len + tx_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, s, 0);
+	if (m == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	// Bounds the wait in tx_slot for the kernel to hand slots back.
+	tv.tv_sec = c.tx_wait_ms / 1000;
+	tv.tv_usec = (c.tx_wait_ms % 1000) * 1000;
+	if (setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	// Not supported before Linux 4.20; without it our own TX shows up on RX.
+	v = 1;
+	(void)setopt(s, PACKET_IGNORE_OUTGOING, &v, sizeof(v));
+
+	if (bind(s, reinterpret_cast<struct sockaddr *>(&sll), sizeof(sll)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	close();
+	name.append(ifname);
+	std::swap(fd, s);
+	addr = new_addr;
+	memcpy(hw, new_hwaddr, sizeof(hw));
+
+	cfg = c;
+	map = static_cast<uint8_t *>(m);
+	map_len = rx_len + tx_len;
+	m = MAP_FAILED;
+	tx_ring = map + rx_len;
+	tx_frames = req.tp_frame_nr;
+
+done:
+	if (m != MAP_FAILED) {
+		munmap(m, rx_len + tx_len);
+	}
+	if (s >= 0) {
+		while (::close(s) < 0 && errno == EINTR) {}
+	}
+	return ec;
+}
+
+void packet_device::close()
+{
+	if (map) {
+		munmap(map, map_len);
+	}
+	map = nullptr;
+	map_len = 0;
+	rx_next = nullptr;
+	rx_block = 0;
+	rx_left = 0;
+	rx_pending = -1;
+	tx_ring = nullptr;
+	tx_frames = 0;
+	tx_next = 0;
+	tx_queued = false;
+	reset();
+}
+
+std::error_code packet_device::next_block()
+{
+	while (rx_left == 0) {
+		auto *bd = ring_block(map, cfg, rx_block);
+		if (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+			rx_left = bd->hdr.bh1.num_pkts;
+			rx_next = reinterpret_cast<uint8_t *>(bd) + bd->hdr.bh1.offset_to_first_pkt;
+			if (rx_left == 0) {
+				__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+				rx_block = (rx_block + 1) % cfg.rx_blocks;
+			}
+		}
+		else {
+			auto ec = wait_rx();
+			if (ec) { return ec; }
+		}
+	}
+	return std::error_code();
+}
+
+struct tpacket3_hdr *packet_device::next_frame()
+{
+	auto *ppd = reinterpret_cast<struct tpacket3_hdr *>(rx_next);
+	rx_next += ppd->tp_next_offset;
+	if (--rx_left == 0) {
+		rx_pending = rx_block;
+		rx_block = (rx_block + 1) % cfg.rx_blocks;
+	}
+	return ppd;
+}
+
+void packet_device::release_block()
+{
+	if (rx_pending >= 0) {
+		auto *bd = ring_block(map, cfg, rx_pending);
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		rx_pending = -1;
+	}
+}
+
+std::error_code packet_device::read_burst(buffer_list &list, buffer_pool &pool, unsigned int max)
+{
+	release_block();
+
+	auto ec = next_block();
+	if (ec) { return ec; }
+
+	unsigned int count = 0;
+	while (count < max && rx_left > 0) {
+		buffer *buf = pool.acquire();
+		if (buf == nullptr) { break; }
+
+		auto *ppd = next_frame();
+		buf->attach(reinterpret_cast<uint8_t *>(ppd) + ppd->tp_mac, ppd->tp_snaplen);
+		buf->bump(ppd->tp_snaplen);
+		if (ppd->tp_status & (TP_STATUS_CSUM_VALID|TP_STATUS_CSUMNOTREADY)) {
+			buf->offload().flags |= OFFLOAD_DATA_VALID;
+		}
+		list.push_back(*buf);
+		count++;
+	}
+
+	if (count == 0) {
+		return std::make_error_code(std::errc::not_enough_memory);
+	}
+	return std::error_code();
+}
+
+std::error_code packet_device::read(buffer &buf)
+{
+	release_block();
+
+	auto ec = next_block();
+	if (ec) { return ec; }
+
+	auto *ppd = next_frame();
+	slice end = buf.end();
+	unsigned int n = std::min((size_t)ppd->tp_snaplen, end.length());
+	memcpy(end.value(), reinterpret_cast<uint8_t *>(ppd) + ppd->tp_mac, n);
+	buf.bump(n);
+
+	// The frame was copied out, so its block can go back right away.
+	release_block();
+	return std::error_code();
+}
+
+ssize_t packet_device::write(const slice &buf, const buffer_offload &ol)
+{
+	(void)ol;
+
+	if (buf.length() > cfg.frame_size - TX_DATA_OFF) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	auto *hdr = tx_slot();
+	if (hdr == nullptr) { return -1; }
+	uint8_t *slot = reinterpret_cast<uint8_t *>(hdr);
+
+	memcpy(slot + TX_DATA_OFF, buf.value(), buf.length());
+	return queue_slot(hdr, buf.length());
+}
+
+ssize_t packet_device::write(buffer_list &pkt, const buffer_offload &ol)
+{
+	(void)ol;
+
+	// The TX ring only takes whole frames, so the segments are gathered
+	// straight into the slot rather than into a frame first.
+	auto *hdr = tx_slot();
+	if (hdr == nullptr) { return -1; }
+	uint8_t *slot = reinterpret_cast<uint8_t *>(hdr);
+
+	size_t len = 0, max = cfg.frame_size - TX_DATA_OFF;
+	for (auto &seg : pkt) {
+		if (seg.length() > max - len) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		memcpy(slot + TX_DATA_OFF + len, seg.data(), seg.length());
+		len += seg.length();
+	}
+	return queue_slot(hdr, len);
+}
+
+struct tpacket3_hdr *packet_device::tx_slot()
+{
+	auto *hdr = reinterpret_cast<struct tpacket3_hdr *>(tx_ring + (size_t)tx_next * cfg.frame_size);
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) == TP_STATUS_AVAILABLE) {
+		return hdr;
+	}
+
+	// The slot is still the kernel's, waiting on a flush or sent and not
+	// yet freed, which happens some time after the send. A blocking send
+	// submits whatever is queued and returns once every frame in flight
+	// is done with, or the send timeout runs out.
+	tx_queued = false;
+	while (::send(fd, nullptr, 0, 0) < 0 && errno == EINTR) {}
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) == TP_STATUS_AVAILABLE) {
+		return hdr;
+	}
+	errno = ENOBUFS;
+	return nullptr;
+}
+
+ssize_t packet_device::queue_slot(struct tpacket3_hdr *hdr, size_t len)
+{
+	hdr->tp_len = len;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	tx_next = (tx_next + 1) % tx_frames;
+	tx_queued = true;
+	return len;
+}
+
+size_t packet_device::rx_dropped() const
+{
+	// Reading the statistics resets them in the kernel.
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+	if (fd < 0 || getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+		return 0;
+	}
+	return st.tp_drops;
+}
+
+std::error_code packet_device::submit_tx()
+{
+	if (!tx_queued) { return std::error_code(); }
+	tx_queued = false;
+
+	// One send walks the ring and transmits every frame marked so far.
+	if (::send(fd, nullptr, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+		return std::error_code(errno, std::system_category());
+	}
+	return std::error_code();
+}
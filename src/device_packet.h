@@ -0,0 +1,71 @@
+#ifndef UNET_DEVICE_PACKET_H
+#define UNET_DEVICE_PACKET_H
+
+#include "device.h"
+
+struct tpacket3_hdr;
+
+namespace unet
+{
+	struct packet_ring_config
+	{
+		unsigned int block_size = 1 << 20; /* octets per ring block */
+		unsigned int rx_blocks = 16;       /* blocks in the RX ring */
+		unsigned int tx_blocks = 4;        /* blocks in the TX ring */
+		unsigned int frame_size = 2048;    /* octets per frame slot */
+		unsigned int timeout_ms = 1;       /* retire partially filled RX blocks */
+		unsigned int tx_wait_ms = 10;      /* longest wait for a TX slot with the ring full */
+	};
+
+	/**
+	 * Device attached to an existing interface through an AF_PACKET socket
+	 * with memory-mapped TPACKET_V3 RX and TX rings. Received frames are
+	 * handed out in place: buffers from read_burst point into the RX ring
+	 * and the block holding them is returned to the kernel on the next read.
+	 */
+	class packet_device final : public device, private nomove
+	{
+		uint8_t *map = nullptr;
+		size_t map_len = 0;
+		packet_ring_config cfg;
+
+		uint8_t *rx_next = nullptr;
+		unsigned int rx_block = 0;
+		unsigned int rx_left = 0;
+		int rx_pending = -1;
+
+		uint8_t *tx_ring = nullptr;
+		unsigned int tx_frames = 0;
+		unsigned int tx_next = 0;
+		bool tx_queued = false;
+
+		std::error_code next_block();
+		struct tpacket3_hdr *next_frame();
+		void release_block();
+		struct tpacket3_hdr *tx_slot();
+		ssize_t queue_slot(struct tpacket3_hdr *hdr, size_t len);
+
+	protected:
+		std::error_code submit_tx() override;
+		size_t rx_dropped() const override;
+
+	public:
+		packet_device() {}
+		~packet_device() { close(); }
+
+		std::error_code open(const char *ifname, const char *addr, const char *hwaddr = nullptr,
+				const packet_ring_config &cfg = packet_ring_config());
+
+		void close() override;
+
+		std::error_code read_burst(buffer_list &list, buffer_pool &pool, unsigned int max) override;
+		std::error_code read(buffer &buf) override;
+
+		using device::write;
+		ssize_t write(const slice &buf, const buffer_offload &ol) override;
+		ssize_t write(buffer_list &pkt, const buffer_offload &ol) override;
+	};
+}
+
+#endif
+
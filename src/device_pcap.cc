@@ -0,0 +1,432 @@
+#include "device_pcap.h"
+#include "pool.h"
+#include "fmt.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+using namespace unet;
+
+#define PCAP_MAGIC_US       0xA1B2C3D4u
+#define PCAP_MAGIC_NS       0xA1B23C4Du
+#define PCAP_HLEN           24
+#define PCAP_RLEN           16
+#define PCAP_SNAPLEN        262144
+#define PCAP_LINK_ETHER     1
+
+#define PCAPNG_SHB          0x0A0D0D0Au
+#define PCAPNG_IDB          0x00000001u
+#define PCAPNG_SPB          0x00000003u
+#define PCAPNG_EPB          0x00000006u
+#define PCAPNG_MAGIC        0x1A2B3C4Du
+#define PCAPNG_IF_TSRESOL   9
+
+#define PCAP_FLUSH          (256 * 1024)  /* TX octets buffered before a write */
+
+static inline uint64_t clock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t load32(const uint8_t *p, bool swap)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t load16(const uint8_t *p, bool swap)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return swap ? __builtin_bswap16(v) : v;
+}
+
+template <typename T>
+static inline void put(std::vector<uint8_t> &out, T val)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(&val);
+	out.insert(out.end(), p, p + sizeof(val));
+}
+
+// Converts a pcapng timestamp to nanoseconds. The if_tsresol option is a
+// negative power of ten, or of two when the top bit is set.
+static uint64_t to_ns(uint64_t t, uint8_t resol)
+{
+	if (resol & 0x80) {
+		return (uint64_t)((unsigned __int128)t * 1000000000 >> (resol & 0x7f));
+	}
+	for (unsigned int e = resol; e < 9; e++) { t *= 10; }
+	for (unsigned int e = resol; e > 9; e--) { t /= 10; }
+	return t;
+}
+
+std::error_code pcap_device::open(const char *path, const char *a, const char *hwa, const pcap_config &c)
+{
+	uint32_t new_addr = 0;
+	uint8_t new_hwaddr[6];
+	std::error_code ec;
+	struct stat sb;
+	void *m;
+	int s = -1;
+
+	if (map) {
+		ec = error::already_open;
+		goto done;
+	}
+
+	if (inet_pton(AF_INET, a, &new_addr) != 1) {
+		ec = error::invalid_ipaddr;
+		goto done;
+	}
+
+	if (sscanf(hwa, UNET_MAC_FMT, UNET_MAC_ARG(&new_hwaddr)) != UNET_MAC_NARG) {
+		ec = error::invalid_hwaddr;
+		goto done;
+	}
+
+	if ((s = ::open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(s, &sb) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+
+	if (sb.st_size < 4) {
+		ec = error::invalid_capture;
+		goto done;
+	}
+
+	// The whole file is faulted in up front so the first pass doesn't
+	// measure the page cache.
+	m = mmap(nullptr, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, s, 0);
+	if (m == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto done;
+	}
+	map = static_cast<uint8_t *>(m);
+	map_len = (size_t)sb.st_size;
+	cfg = c;
+
+	ec = load32(map, false) == PCAPNG_SHB ? index_pcapng() : index_pcap();
+	if (!ec && !cfg.tx_path.empty()) {
+		out = ::open(cfg.tx_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (out < 0) {
+			ec = std::error_code(errno, std::system_category());
+		}
+		else {
+			put<uint32_t>(pending, PCAP_MAGIC_NS);
+			put<uint16_t>(pending, 2);
+			put<uint16_t>(pending, 4);
+			put<int32_t>(pending, 0);
+			put<uint32_t>(pending, 0);
+			put<uint32_t>(pending, PCAP_SNAPLEN);
+			put<uint32_t>(pending, PCAP_LINK_ETHER);
+		}
+	}
+	if (ec) {
+		close();
+		goto done;
+	}
+
+	// Timestamps become offsets from the first frame, and are kept from
+	// going backwards so pacing never waits on an out of order frame. A
+	// pass lasts as long as the file plus one mean gap, so the first frame
+	// of the next pass doesn't land on top of the last one.
+	if (!frames.empty()) {
+		uint64_t t0 = frames.front().ts;
+		uint64_t prev = t0;
+		for (auto &f : frames) {
+			prev = std::max(prev, f.ts);
+			f.ts = prev - t0;
+		}
+		span = frames.back().ts;
+		if (frames.size() > 1) { span += span / (frames.size() - 1); }
+	}
+
+	name = path;
+	addr = new_addr;
+	memcpy(hw, new_hwaddr, sizeof(hw));
+
+done:
+	if (s >= 0) {
+		while (::close(s) < 0 && errno == EINTR) {}
+	}
+	return ec;
+}
+
+std::error_code pcap_device::index_pcap()
+{
+	bool swap;
+	uint64_t unit;
+
+	switch (load32(map, false)) {
+	case PCAP_MAGIC_US: swap = false; unit = 1000; break;
+	case PCAP_MAGIC_NS: swap = false; unit = 1; break;
+	case __builtin_bswap32(PCAP_MAGIC_US): swap = true; unit = 1000; break;
+	case __builtin_bswap32(PCAP_MAGIC_NS): swap = true; unit = 1; break;
+	default: return error::invalid_capture;
+	}
+
+	// The top bits of the link type may carry FCS information.
+	if (map_len < PCAP_HLEN || (load32(map + 20, swap) & 0x0FFFFFFF) != PCAP_LINK_ETHER) {
+		return error::invalid_capture;
+	}
+
+	// A record cut short by the end of the file ends the index, as it
+	// would for a capture that was still being written.
+	for (size_t off = PCAP_HLEN; map_len - off >= PCAP_RLEN;) {
+		const uint8_t *r = map + off;
+		uint32_t caplen = load32(r + 8, swap);
+		if (caplen > map_len - off - PCAP_RLEN) { break; }
+
+		uint64_t ts = (uint64_t)load32(r, swap) * 1000000000 + load32(r + 4, swap) * unit;
+		frames.push_back(frame{off + PCAP_RLEN, caplen, ts});
+		off += PCAP_RLEN + caplen;
+	}
+	return std::error_code();
+}
+
+std::error_code pcap_device::index_pcapng()
+{
+	struct iface
+	{
+		bool ether;
+		uint8_t resol;
+	};
+
+	std::vector<iface> ifaces;
+	bool swap = false;
+
+	for (size_t off = 0; map_len - off >= 12;) {
+		const uint8_t *b = map + off;
+		uint32_t type = load32(b, swap);
+
+		// Each section sets its own byte order and numbers its own
+		// interfaces from zero.
+		if (type == PCAPNG_SHB) {
+			uint32_t magic = load32(b + 8, false);
+			if (magic == PCAPNG_MAGIC) { swap = false; }
+			else if (magic == __builtin_bswap32(PCAPNG_MAGIC)) { swap = true; }
+			else { return error::invalid_capture; }
+			ifaces.clear();
+		}
+		else if (off == 0) {
+			return error::invalid_capture;
+		}
+
+		uint32_t len = load32(b + 4, swap);
+		if (len < 12 || len % 4 || len > map_len - off) { break; }
+
+		switch (type) {
+		case PCAPNG_IDB:
+			if (len >= 20) {
+				iface i = { load16(b + 8, swap) == PCAP_LINK_ETHER, 6 };
+				for (uint32_t o = 16; o + 4 <= len - 4;) {
+					uint16_t code = load16(b + o, swap);
+					uint16_t olen = load16(b + o + 2, swap);
+					if (code == 0 || o + 4 + olen > len - 4) { break; }
+					if (code == PCAPNG_IF_TSRESOL && olen >= 1) { i.resol = b[o + 4]; }
+					o += 4 + ((olen + 3) & ~3u);
+				}
+				ifaces.push_back(i);
+			}
+			break;
+
+		case PCAPNG_EPB:
+			if (len >= 32) {
+				uint32_t id = load32(b + 8, swap);
+				uint32_t caplen = load32(b + 20, swap);
+				if (id < ifaces.size() && ifaces[id].ether && caplen <= len - 32) {
+					uint64_t t = (uint64_t)load32(b + 12, swap) << 32 | load32(b + 16, swap);
+					frames.push_back(frame{off + 28, caplen, to_ns(t, ifaces[id].resol)});
+				}
+			}
+			break;
+
+		case PCAPNG_SPB:
+			// Simple packets carry no timestamp, so they replay back to
+			// back with the frame before them.
+			if (len >= 16 && !ifaces.empty() && ifaces[0].ether) {
+				uint32_t caplen = std::min(load32(b + 8, swap), len - 16);
+				uint64_t ts = frames.empty() ? 0 : frames.back().ts;
+				frames.push_back(frame{off + 12, caplen, ts});
+			}
+			break;
+		}
+		off += len;
+	}
+	return std::error_code();
+}
+
+void pcap_device::close()
+{
+	if (out >= 0) {
+		drain();
+		while (::close(out) < 0 && errno == EINTR) {}
+		out = -1;
+	}
+	pending.clear();
+
+	if (map) {
+		munmap(map, map_len);
+		map = nullptr;
+		map_len = 0;
+	}
+	frames.clear();
+	span = 0;
+	next = 0;
+	pass = 0;
+	start = 0;
+	reset();
+}
+
+bool pcap_device::ready(bool wait, std::error_code &ec)
+{
+	if (next == frames.size()) {
+		if (frames.empty() || (cfg.loops && pass + 1 >= cfg.loops)) {
+			ec = error::end_of_replay;
+			return false;
+		}
+		pass++;
+		next = 0;
+	}
+	if (!cfg.paced) {
+		return true;
+	}
+
+	uint64_t now = clock_ns();
+	if (start == 0) { start = now; }
+
+	uint64_t due = start + (uint64_t)pass * span + frames[next].ts;
+	if (due <= now) {
+		return true;
+	}
+	if (!wait) {
+		return false;
+	}
+
+	struct timespec ts = { (time_t)(due / 1000000000), (long)(due % 1000000000) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+	return true;
+}
+
+void pcap_device::take(buffer &buf)
+{
+	const frame &f = frames[next];
+	slice end = buf.end();
+	unsigned int n = std::min((unsigned int)f.len, (unsigned int)end.length());
+
+	memcpy(end.value(), map + f.off, n);
+	buf.bump(n);
+	st.rx_frames++;
+	st.rx_bytes += n;
+
+	if (++next == frames.size()) { st.passes++; }
+}
+
+std::error_code pcap_device::read(buffer &buf)
+{
+	std::error_code ec;
+	if (!ready(true, ec)) {
+		return ec;
+	}
+	take(buf);
+	return ec;
+}
+
+std::error_code pcap_device::read_burst(buffer_list &list, buffer_pool &pool, unsigned int max)
+{
+	std::error_code ec;
+	unsigned int count = 0;
+
+	// Only the first frame of a burst is waited for; a paced burst ends
+	// at the first frame that isn't due yet.
+	while (count < max && ready(count == 0, ec)) {
+		buffer *buf = pool.acquire();
+		if (!buf) { break; }
+		take(*buf);
+		list.push_back(*buf);
+		count++;
+	}
+
+	if (count > 0) {
+		return std::error_code();
+	}
+	return ec ? ec : std::make_error_code(std::errc::not_enough_memory);
+}
+
+void pcap_device::record(uint32_t len)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	st.tx_frames++;
+	st.tx_bytes += len;
+	if (out < 0) {
+		return;
+	}
+
+	put<uint32_t>(pending, (uint32_t)ts.tv_sec);
+	put<uint32_t>(pending, (uint32_t)ts.tv_nsec);
+	put<uint32_t>(pending, len);
+	put<uint32_t>(pending, len);
+}
+
+ssize_t pcap_device::write(const slice &buf, const buffer_offload &)
+{
+	record(buf.length());
+	if (out >= 0) {
+		pending.insert(pending.end(), buf.value(), buf.value() + buf.length());
+	}
+	return buf.length();
+}
+
+ssize_t pcap_device::write(buffer_list &pkt, const buffer_offload &)
+{
+	size_t len = 0;
+	unsigned int n = 0;
+	for (auto &seg : pkt) {
+		if (n++ == UNET_MAX_SEGS) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		len += seg.length();
+	}
+
+	record(len);
+	if (out >= 0) {
+		for (auto &seg : pkt) {
+			pending.insert(pending.end(), seg.data(), seg.data() + seg.length());
+		}
+	}
+	return len;
+}
+
+std::error_code pcap_device::submit_tx()
+{
+	// A file takes bigger writes than a burst makes, so frames collect
+	// until there are enough of them.
+	return pending.size() >= PCAP_FLUSH ? drain() : std::error_code();
+}
+
+std::error_code pcap_device::drain()
+{
+	size_t n = 0;
+	while (n < pending.size()) {
+		ssize_t rc = ::write(out, pending.data() + n, pending.size() - n);
+		if (rc < 0) {
+			if (errno == EINTR) { continue; }
+			return std::error_code(errno, std::system_category());
+		}
+		n += rc;
+	}
+	pending.clear();
+	return std::error_code();
+}
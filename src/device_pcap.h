@@ -0,0 +1,89 @@
+#ifndef UNET_DEVICE_PCAP_H
+#define UNET_DEVICE_PCAP_H
+
+#include <vector>
+
+#include "device.h"
+
+namespace unet
+{
+	struct pcap_config
+	{
+		bool paced = false;          /* replay at the spacing of the original timestamps */
+		unsigned int loops = 1;      /* passes over the file, 0 to repeat forever */
+		std::string tx_path;         /* pcap file for sent frames, empty to only count them */
+	};
+
+	struct pcap_stats
+	{
+		size_t rx_frames;    /* frames handed out by read */
+		size_t rx_bytes;     /* octets in those frames */
+		size_t tx_frames;    /* frames written */
+		size_t tx_bytes;     /* octets in those frames */
+		size_t passes;       /* times the end of the file was reached */
+	};
+
+	/**
+	 * Device that replays the Ethernet frames of a pcap or pcapng file and
+	 * sinks whatever is sent, so the stack can be driven without root, a
+	 * TAP interface, or a network. The file is memory-mapped and indexed
+	 * once by open; frames are copied into pool buffers as they are read,
+	 * since handlers rewrite frames in place and every pass over the file
+	 * has to see the same bytes. Reads fail with error::end_of_replay once
+	 * the last pass is done.
+	 */
+	class pcap_device final : public device, private nomove
+	{
+		struct frame
+		{
+			size_t off;      /* offset of the frame in the map */
+			uint32_t len;    /* captured octets */
+			uint64_t ts;     /* nanoseconds since the first frame */
+		};
+
+		uint8_t *map = nullptr;
+		size_t map_len = 0;
+		pcap_config cfg;
+
+		std::vector<frame> frames;
+		uint64_t span = 0;
+		size_t next = 0;
+		unsigned int pass = 0;
+		uint64_t start = 0;
+
+		int out = -1;
+		std::vector<uint8_t> pending;
+		pcap_stats st = {};
+
+		std::error_code index_pcap();
+		std::error_code index_pcapng();
+		bool ready(bool wait, std::error_code &ec);
+		void take(buffer &buf);
+		void record(uint32_t len);
+		std::error_code drain();
+
+	protected:
+		std::error_code submit_tx() override;
+
+	public:
+		pcap_device() {}
+		~pcap_device() { close(); }
+
+		std::error_code open(const char *path, const char *addr, const char *hwaddr,
+				const pcap_config &cfg = pcap_config());
+
+		void close() override;
+
+		std::error_code read_burst(buffer_list &list, buffer_pool &pool, unsigned int max) override;
+		std::error_code read(buffer &buf) override;
+
+		using device::write;
+		ssize_t write(const slice &buf, const buffer_offload &ol) override;
+		ssize_t write(buffer_list &pkt, const buffer_offload &ol) override;
+
+		size_t size() const { return frames.size(); }
+		const pcap_stats &get_stats() const { return st; }
+	};
+}
+
+#endif
@@ -1,4 +1,6 @@
-#include "device.h"
+#include "device_tun.h"
+#include "uring.h"
+#include "pool.h"
 #include "fmt.h"
 
 #include <stdio.h>
@@ -8,12 +10,20 @@
 #include <err.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
 
 using namespace unet;
 
+// <linux/virtio_net.h> does not compile as C++, so the legacy header size
+// is spelled out; buffer_offload mirrors struct virtio_net_hdr field for field.
+#define VNET_HLEN 10
+#define VNET_OFFLOADS (TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN)
+
+static_assert(sizeof(buffer_offload) == VNET_HLEN, "buffer_offload must match virtio_net_hdr");
+
 #define cmd(...) __extension__ ({ \
 	char buf[4096]; \
 	snprintf(buf, sizeof(buf), __VA_ARGS__); \
@@ -35,12 +45,74 @@ static int if_up(const char *dev)
 	return cmd("ip link set dev %s up", dev);
 }
 
-std::error_code device::open(const char *a, const char *r, const char *hwa, const char *dev)
+static int tun_alloc(struct ifreq &ifr, std::error_code &ec)
+{
+	int s = ::open("/dev/net/tun", O_RDWR);
+	if (s < 0) {
+		ec = std::error_code(errno, std::system_category());
+		return -1;
+	}
+
+	if (ioctl(s, TUNSETIFF, (void *) &ifr) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	if ((ifr.ifr_flags & IFF_VNET_HDR) && ioctl(s, TUNSETOFFLOAD, VNET_OFFLOADS) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	// Reads are non-blocking so a burst can drain the queue and stop at
+	// EAGAIN; wait_rx blocks when there is nothing to read.
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	return s;
+
+fail:
+	while (::close(s) < 0 && errno == EINTR) {}
+	return -1;
+}
+
+tun_device::tun_device() {}
+tun_device::~tun_device() { close(); }
+
+tun_device::tun_device(tun_device &&src) :
+	uio(std::move(src.uio))
+{
+	move(src);
+}
+
+tun_device &tun_device::operator=(tun_device &&src)
+{
+	uio = std::move(src.uio);
+	move(src);
+	return *this;
+}
+
+static short tun_flags(unsigned int flags)
+{
+	short f = IFF_TAP | IFF_NO_PI;
+	if (flags & DEVICE_MULTI_QUEUE) { f |= IFF_MULTI_QUEUE; }
+	if (flags & DEVICE_VNET_HDR) { f |= IFF_VNET_HDR; }
+	return f;
+}
+
+std::error_code tun_device::open(const char *a, const char *r, const char *hwa, const char *dev, unsigned int fl)
 {
 	uint32_t new_addr = 0;
 	uint8_t new_hwaddr[6];
 	int s = -1;
 	std::error_code ec;
+	struct ifreq ifr;
+
+	if ((fl & DEVICE_IO_URING) && (fl & DEVICE_VNET_HDR)) {
+		ec = error::invalid_flags;
+		goto done;
+	}
 
 	if (inet_pton(AF_INET, a, &new_addr) != 1) {
 		ec = error::invalid_ipaddr;
@@ -52,21 +124,14 @@ std::error_code device::open(const char *a, const char *r, const char *hwa, cons
 		goto done;
 	}
 
-	if ((s = ::open("/dev/net/tun", O_RDWR)) < 0) {
-		ec = std::error_code(errno, std::system_category());
-		goto done;
-	}
-
-	struct ifreq ifr;
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = tun_flags(fl);
 
 	if (*dev) {
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 	}
 
-	if (ioctl(s, TUNSETIFF, (void *) &ifr) < 0) {
-		ec = std::error_code(errno, std::system_category());
+	if ((s = tun_alloc(ifr, ec)) < 0) {
 		goto done;
 	}
 
@@ -91,9 +156,14 @@ std::error_code device::open(const char *a, const char *r, const char *hwa, cons
 	name.clear();
 	name.append(ifr.ifr_name);
 	std::swap(fd, s);
+	flags = fl;
 	addr = new_addr;
 	memcpy(hw, new_hwaddr, sizeof(hw));
 
+	if ((ec = start_uring())) {
+		close();
+	}
+
 done:
 	if (s >= 0) {
 		while (::close(s) < 0 && errno == EINTR) {}
@@ -101,28 +171,184 @@ done:
 	return ec;
 }
 
-void device::close()
+std::error_code tun_device::attach(const tun_device &dev)
 {
-	if (fd < 0) { return; }
-	while (::close(fd) < 0 && errno == EINTR) {}
-	name.clear();
-	fd = -1;
-	addr = 0;
-	memset(hw, 0, sizeof(hw));
+	if (dev.fd < 0) {
+		return std::error_code(EBADF, std::system_category());
+	}
+	if (!(dev.flags & DEVICE_MULTI_QUEUE)) {
+		return error::not_multi_queue;
+	}
+
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = tun_flags(dev.flags);
+	strncpy(ifr.ifr_name, dev.name.c_str(), IFNAMSIZ);
+
+	std::error_code ec;
+	int s = tun_alloc(ifr, ec);
+	if (s < 0) {
+		return ec;
+	}
+
+	close();
+	name = dev.name;
+	fd = s;
+	flags = dev.flags;
+	addr = dev.addr;
+	memcpy(hw, dev.hw, sizeof(hw));
+
+	if ((ec = start_uring())) {
+		close();
+	}
+	return ec;
+}
+
+std::error_code tun_device::start_uring()
+{
+	if (!(flags & DEVICE_IO_URING)) {
+		return std::error_code();
+	}
+	uio.reset(new uring_io);
+	return uio->open(fd);
+}
+
+void tun_device::close()
+{
+	uio.reset();
+	reset();
 }
 
-std::error_code device::read(buffer &buf)
+static ssize_t tun_read(int fd, buffer &buf, bool vnet)
 {
 	slice end = buf.end();
-	ssize_t n = ::read(fd, end.value(), end.length());
-	if (n < 0) { return std::error_code(errno, std::system_category()); }
-	if (n == 0) { return std::error_code(EBADF, std::system_category()); }
-	buf.bump((size_t)n);
+	if (!vnet) {
+		return ::read(fd, end.value(), end.length());
+	}
+
+	struct iovec iov[2] = {
+		{ &buf.offload(), VNET_HLEN },
+		{ end.value(), end.length() },
+	};
+	ssize_t n = ::readv(fd, iov, 2);
+	if (n < 0) { return n; }
+	if ((size_t)n < VNET_HLEN) {
+		errno = EIO;
+		return -1;
+	}
+	return n - VNET_HLEN;
+}
+
+std::error_code tun_device::read(buffer &buf)
+{
+	if (uio) {
+		return uio->read(buf);
+	}
+
+	for (;;) {
+		ssize_t n = tun_read(fd, buf, has_offload());
+		if (n > 0) {
+			buf.bump((size_t)n);
+			return std::error_code();
+		}
+		if (n == 0) { return std::error_code(EBADF, std::system_category()); }
+		if (errno == EAGAIN) {
+			auto ec = wait_rx();
+			if (ec) { return ec; }
+		}
+		else if (errno != EINTR) {
+			return std::error_code(errno, std::system_category());
+		}
+	}
+}
+
+std::error_code tun_device::read_burst(buffer_list &list, buffer_pool &pool, unsigned int max)
+{
+	if (uio) {
+		return uio->read_burst(list, pool, max);
+	}
+
+	buffer::unique_ptr buf;
+	unsigned int count = 0;
+
+	while (count < max) {
+		if (!buf) {
+			buf.reset(pool.acquire());
+			if (!buf) { break; }
+		}
+
+		ssize_t n = tun_read(fd, *buf, has_offload());
+		if (n > 0) {
+			buf->bump((size_t)n);
+			list.push_back(*buf.release());
+			count++;
+		}
+		else if (n == 0) {
+			return std::error_code(EBADF, std::system_category());
+		}
+		else if (errno == EAGAIN) {
+			if (count > 0) { break; }
+			auto ec = wait_rx();
+			if (ec) { return ec; }
+		}
+		else if (errno != EINTR) {
+			return std::error_code(errno, std::system_category());
+		}
+	}
+
+	if (count == 0) {
+		return std::make_error_code(std::errc::not_enough_memory);
+	}
 	return std::error_code();
 }
 
-ssize_t device::write(const slice &buf)
+ssize_t tun_device::write(const slice &buf, const buffer_offload &ol)
 {
-	return ::write(fd, buf.value(), buf.length());
+	if (uio) {
+		return uio->write(buf);
+	}
+	if (!has_offload()) {
+		return ::write(fd, buf.value(), buf.length());
+	}
+
+	struct iovec iov[2] = {
+		{ const_cast<buffer_offload *>(&ol), VNET_HLEN },
+		{ const_cast<uint8_t *>(buf.value()), buf.length() },
+	};
+	ssize_t n = ::writev(fd, iov, 2);
+	if (n < 0) { return n; }
+	return (size_t)n < VNET_HLEN ? 0 : n - VNET_HLEN;
 }
 
+
+std::error_code tun_device::submit_tx()
+{
+	// Plain TAP writes can't be batched: each write is a frame and goes
+	// out as it is made.
+	return uio ? uio->flush() : std::error_code();
+}
+
+ssize_t tun_device::write(buffer_list &pkt, const buffer_offload &ol)
+{
+	if (uio) {
+		return uio->write(pkt);
+	}
+
+	struct iovec iov[UNET_MAX_SEGS + 1];
+	int n = 0;
+	if (has_offload()) {
+		iov[n++] = { const_cast<buffer_offload *>(&ol), VNET_HLEN };
+	}
+	int max = n + UNET_MAX_SEGS;
+	for (auto &seg : pkt) {
+		if (n == max) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		iov[n++] = { seg.data(), seg.length() };
+	}
+
+	ssize_t rc = ::writev(fd, iov, n);
+	if (rc < 0 || !has_offload()) { return rc; }
+	return (size_t)rc < VNET_HLEN ? 0 : rc - VNET_HLEN;
+}
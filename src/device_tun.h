@@ -0,0 +1,44 @@
+#ifndef UNET_DEVICE_TUN_H
+#define UNET_DEVICE_TUN_H
+
+#include <memory>
+
+#include "device.h"
+
+namespace unet
+{
+	class uring_io;
+
+	class tun_device final : public device
+	{
+		std::unique_ptr<uring_io> uio;
+
+		std::error_code start_uring();
+
+	protected:
+		std::error_code submit_tx() override;
+
+	public:
+		tun_device();
+		~tun_device();
+
+		tun_device(tun_device &&src);
+		tun_device &operator=(tun_device &&src);
+
+		std::error_code open(const char *addr, const char *route, const char *hwaddr,
+				const char *name = "", unsigned int flags = 0);
+		std::error_code attach(const tun_device &dev);
+
+		void close() override;
+
+		std::error_code read_burst(buffer_list &list, buffer_pool &pool, unsigned int max) override;
+		std::error_code read(buffer &buf) override;
+
+		using device::write;
+		ssize_t write(const slice &buf, const buffer_offload &ol) override;
+		ssize_t write(buffer_list &pkt, const buffer_offload &ol) override;
+	};
+}
+
+#endif
+
@@ -14,6 +14,11 @@ public:
 		case unet::error::already_open: return "Device is already open";
 		case unet::error::invalid_hwaddr: return "Invalid hardware address";
 		case unet::error::invalid_ipaddr: return "Invalid IP address";
+		case unet::error::not_multi_queue: return "Device is not multi-queue";
+		case unet::error::invalid_flags: return "Unsupported combination of device flags";
+		case unet::error::invalid_capture: return "Invalid or unsupported capture file";
+		case unet::error::end_of_replay: return "End of replay";
+		case unet::error::invalid_log: return "Invalid log file";
 		default: return "Unknown error";
 		}
 	}
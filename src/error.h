@@ -11,6 +11,11 @@ namespace unet
 		already_open = 1,
 		invalid_ipaddr,
 		invalid_hwaddr,
+		not_multi_queue,
+		invalid_flags,
+		invalid_capture,
+		end_of_replay,
+		invalid_log,
 	};
 
 	const std::error_category &error_category();
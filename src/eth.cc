@@ -1,6 +1,8 @@
 #include "eth.h"
+#include "device.h"
 #include "fmt.h"
 #include "host.h"
+#include "log.h"
 
 using namespace unet;
 
@@ -8,6 +10,37 @@ static const uint8_t broadcast_hw[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
 const uint8_t *unet::broadcast_hwaddr = broadcast_hw;
 
+namespace
+{
+	struct slot_table
+	{
+		uint8_t slot[1 << 16];
+	};
+
+	static_assert(eth_slots <= 256, "eth slots must fit in a uint8_t");
+
+	// Built by the compiler. The most common types take the first slots,
+	// so their handlers share the first cache line of every stack's table.
+	constexpr slot_table make_slots()
+	{
+		slot_table t{};
+		const eth_type common[] = { ETH_IP, ETH_ARP, ETH_IPV6, ETH_IEEE8021Q, ETH_IEEE8021AD };
+		unsigned int n = 1;
+		for (eth_type type : common) {
+			t.slot[type] = n++;
+		}
+#define X(name, val) if (t.slot[val] == 0) { t.slot[val] = n++; }
+		UNET_ETH_TYPE
+#undef X
+		return t;
+	}
+
+	constexpr slot_table slots = make_slots();
+
+	static_assert(slots.slot[ETH_IP] == 1 && slots.slot[ETH_ARP] == 2, "common eth types must come first");
+	static_assert(slots.slot[0xFFFF] == 0, "unlisted eth types must use slot 0");
+}
+
 const char *unet::eth_name(eth_type type)
 {
 	switch (type) {
@@ -18,26 +51,158 @@ const char *unet::eth_name(eth_type type)
 	return "(unknown)";
 }
 
-void eth::recv(const slice &buf)
+eth::eth(device &dev) :
+	_timers(coarse_clock_ms()),
+	_arp(dev),
+	_ip(dev.ipaddr(), _timers),
+	_icmp(dev, _ip, _timers)
+{
+	init();
+}
+
+eth::eth(device &dev, arp_cache &cache) :
+	_timers(coarse_clock_ms()),
+	_arp(dev, cache),
+	_ip(dev.ipaddr(), _timers),
+	_icmp(dev, _ip, _timers)
 {
+	init();
+}
+
+void eth::init()
+{
+	for (auto &b : handlers) {
+		b = binding{unknown, this, TRACE_OTHER};
+	}
+	attach(ETH_IP, [](void *ctx, buffer &frame, const slice &payload) {
+		static_cast<unet::ip *>(ctx)->recv(frame, payload);
+	}, &_ip);
+	attach(ETH_ARP, [](void *ctx, buffer &frame, const slice &payload) {
+		static_cast<unet::arp *>(ctx)->recv(frame, payload);
+	}, &_arp);
+}
+
+bool eth::attach(eth_type type, handler fn, void *ctx)
+{
+	unsigned int slot = slots.slot[type];
+	if (slot == 0) {
+		return false;
+	}
+	trace_stage stage = type == ETH_IP ? TRACE_IP : type == ETH_ARP ? TRACE_ARP : TRACE_OTHER;
+	handlers[slot] = binding{fn, ctx, stage};
+	return true;
+}
+
+void eth::detach(eth_type type)
+{
+	unsigned int slot = slots.slot[type];
+	if (slot != 0) {
+		handlers[slot] = binding{unknown, this, TRACE_OTHER};
+	}
+}
+
+void eth::unknown(void *ctx, buffer &, const slice &)
+{
+	static_cast<eth *>(ctx)->st->unknown++;
+}
+
+void eth::recv(buffer &frame)
+{
+	slice buf = frame.begin();
+	st->received++;
+	st->bytes += buf.length();
+	if (buf.length() < UNET_ETH_HLEN) {
+		st->runts++;
+		return;
+	}
+
 	const eth_hdr &hdr = buf.as<eth_hdr>();
-	if (hdr.has_type(ETH_ARP)) {
-		_arp.recv(buf.trim_left(UNET_ETH_HLEN));
+	log_event(LOG_ETH_RX, &hdr, UNET_ETH_HLEN);
+	const binding &b = handlers[slots.slot[hdr.type()]];
+	uint64_t t = trace_mark(TRACE_ETH);
+	b.fn(b.ctx, frame, buf.trim_left(UNET_ETH_HLEN));
+	trace_stop(b.stage, t);
+}
+
+void eth::dispatch(buffer &frame)
+{
+	slice buf = frame.begin();
+	if (buf.length() < UNET_ETH_HLEN) {
+		st->runts++;
+		return;
 	}
-#if 0
-	else {
-		fio::out() << hdr << fio::endl;
+
+	const eth_hdr &hdr = buf.as<eth_hdr>();
+	const binding &b = handlers[slots.slot[hdr.type()]];
+	b.fn(b.ctx, frame, buf.trim_left(UNET_ETH_HLEN));
+}
+
+void eth::recv_burst(buffer_list &frames)
+{
+	for (auto &buf : frames) {
+		if (frames.has_next(buf)) {
+			__builtin_prefetch(frames.next(buf).data());
+		}
+		recv(buf);
 	}
-#endif
+}
+
+void eth::collect(counter_set &out) const
+{
+	out.add("eth.received", st->received);
+	out.add("eth.bytes", st->bytes);
+	out.add("eth.runts", st->runts);
+	out.add("eth.unknown", st->unknown);
+
+	auto &a = _arp.get_stats();
+	out.add("arp.received", a.received);
+	out.add("arp.bad", a.bad);
+	out.add("arp.learned", a.learned);
+	out.add("arp.replies", a.replies);
+	out.add("arp.hits", a.hits);
+	out.add("arp.misses", a.misses);
+	out.add("arp.dropped", a.dropped);
+
+	auto &i = _ip.get_stats();
+	out.add("ip.received", i.received);
+	out.add("ip.delivered", i.delivered);
+	out.add("ip.bad_header", i.bad_header);
+	out.add("ip.bad_checksum", i.bad_checksum);
+	out.add("ip.not_local", i.not_local);
+	out.add("ip.fragments", i.fragments);
+	out.add("ip.no_proto", i.no_proto);
+
+	auto &r = _ip.get_reasm_stats();
+	out.add("ip.reasm.fragments", r.fragments);
+	out.add("ip.reasm.reassembled", r.reassembled);
+	out.add("ip.reasm.timeouts", r.timeouts);
+	out.add("ip.reasm.evicted", r.evicted);
+	out.add("ip.reasm.overlaps", r.overlaps);
+	out.add("ip.reasm.duplicates", r.duplicates);
+	out.add("ip.reasm.invalid", r.invalid);
+	out.add("ip.reasm.no_buffer", r.no_buffer);
+	out.add("ip.reasm.mem", r.mem);
+
+	auto &c = _icmp.get_stats();
+	out.add("icmp.received", c.received);
+	out.add("icmp.bad", c.bad);
+	out.add("icmp.echo_replies", c.echo_replies);
+	out.add("icmp.limited", c.limited);
+	out.add("icmp.ignored", c.ignored);
+}
+
+int unet::eth_format(char *buf, size_t len, const eth_hdr &hdr)
+{
+	return snprintf(buf, len, "eth (%s " UNET_MAC_FMT "->" UNET_MAC_FMT ")",
+			eth_name(static_cast<eth_type>(hdr.type())),
+			UNET_MAC_ARG(hdr.smac),
+			UNET_MAC_ARG(hdr.dmac));
 }
 
 fio::ostream &operator<<(fio::ostream &os, const eth_hdr &v)
 {
 	char buf[256];
-	int len = snprintf(buf, sizeof(buf), "eth (%s " UNET_MAC_FMT "->" UNET_MAC_FMT ")",
-			eth_name(static_cast<eth_type>(v.type())),
-			UNET_MAC_ARG(v.smac),
-			UNET_MAC_ARG(v.dmac));
+	int len = eth_format(buf, sizeof(buf), v);
 	return os.write(buf, len);
 }
 
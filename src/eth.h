@@ -6,9 +6,14 @@
 #include "fio/fio.h"
 #include "base.h"
 #include "slice.h"
+#include "buffer.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
+#include "timer.h"
 #include "host.h"
+#include "stats.h"
+#include "trace.h"
 
 #define UNET_ETH_ALEN       6    /* Octets in one ethernet addr */
 #define UNET_ETH_HLEN       14   /* Total octets in header. */
@@ -16,6 +21,9 @@
 #define UNET_ETH_DATA_LEN   1500 /* Max. octets in payload */
 #define UNET_ETH_FRAME_LEN  1514 /* Max. octets in frame sans FCS */
 #define UNET_ETH_FCS_LEN    4    /* Octets in the FCS */
+#define UNET_VLAN_HLEN      4    /* Octets in one 802.1Q tag */
+#define UNET_VLAN_MAXTAGS   2    /* Max. tags on one frame, for QinQ */
+#define UNET_VLAN_N_VID     4096 /* VLAN IDs, 0 and 4095 reserved */
 
 #define UNET_ETH_TYPE \
 	X(AARP,        0x80F3) /* Appletalk AARP */ \
@@ -112,6 +120,13 @@ namespace unet
 
 	const char *eth_name(eth_type type);
 
+	// One dispatch slot per type in UNET_ETH_TYPE, and slot 0 for the rest.
+	constexpr unsigned int eth_slots = 1
+#define X(name, val) + 1
+		UNET_ETH_TYPE
+#undef X
+		;
+
 	struct eth_hdr : private nocopy, private nomove
 	{
 		uint8_t  dmac[6];
@@ -124,18 +139,119 @@ namespace unet
 		void set_type(uint16_t val) { _type = hton16(val); }
 	} __attribute__((packed));
 
+	/**
+	 * Link layer of one stack. Frames are dispatched on their type through
+	 * a table with a slot for every type in UNET_ETH_TYPE, so the cost of
+	 * a frame doesn't depend on the type or on how many handlers there
+	 * are. ARP and IPv4 are attached when the stack is built; anything
+	 * else can be attached later, and frames of a type with no handler are
+	 * counted and dropped.
+	 */
 	class eth
 	{
+	public:
+		/**
+		 * Handlers get the frame and the payload behind its Ethernet
+		 * header, which lies within it. Either may be rewritten by a
+		 * handler that replies in place.
+		 */
+		using handler = void (*)(void *ctx, buffer &frame, const slice &payload);
+		using tick_fn = void (*)(void *ctx, uint64_t now);
+
+		struct stats
+		{
+			size_t received;      /* frames handed to recv */
+			size_t bytes;         /* octets in those frames */
+			size_t runts;         /* frames too short for a header */
+			size_t unknown;       /* frames of a type with no handler */
+		};
+
+	private:
+		struct binding
+		{
+			handler fn;
+			void *ctx;
+			trace_stage stage;
+		};
+
+		timer_wheel _timers;
 		unet::arp _arp;
 		unet::ip _ip;
+		unet::icmp _icmp;
+		padded<stats> st;
+		binding handlers[eth_slots];
+		tick_fn on_tick = nullptr;
+		void *tick_ctx = nullptr;
+
+		void init();
+		static void unknown(void *ctx, buffer &frame, const slice &payload);
+
 	public:
-		void recv(const slice &buf);
+		explicit eth(device &dev);
+		eth(device &dev, arp_cache &cache);
+
+		void recv(buffer &buf);
+		void recv_burst(buffer_list &frames);
+
+		/**
+		 * Hands a frame this stack has already received, with an outer
+		 * header stripped by one of its handlers, to the handler for its
+		 * type. It isn't counted again.
+		 */
+		void dispatch(buffer &frame);
+
+		/**
+		 * Receives a frame a handler of another stack has stripped of an
+		 * outer header. It is counted as recv counts it, but not traced
+		 * again: its time stays with the stage of that handler.
+		 */
+		void deliver(buffer &frame)
+		{
+			st->received++;
+			st->bytes += frame.length();
+			dispatch(frame);
+		}
+
+		/**
+		 * Sends frames of type to fn, in place of any handler it had.
+		 * Returns false if the type is not in UNET_ETH_TYPE.
+		 */
+		bool attach(eth_type type, handler fn, void *ctx = nullptr);
+		void detach(eth_type type);
+
+		/**
+		 * Calls fn on every tick, after the stack's own timers, in place
+		 * of any set before. For handlers that run stacks of their own.
+		 */
+		void set_tick(tick_fn fn, void *ctx)
+		{
+			on_tick = fn;
+			tick_ctx = ctx;
+		}
+
+		void tick(uint64_t now)
+		{
+			_timers.advance(now);
+			_arp.tick(now);
+			if (on_tick) { on_tick(tick_ctx, now); }
+		}
 
 		unet::arp &arp() { return _arp; }
 		unet::ip &ip() { return _ip; }
+		unet::icmp &icmp() { return _icmp; }
+
+		const stats &get_stats() const { return *st; }
+
+		/**
+		 * Adds the counters of this stack, from the link layer up, to out.
+		 */
+		void collect(counter_set &out) const;
 	};
 
 	static_assert(sizeof(eth_hdr) == UNET_ETH_HLEN, "eth_hdr size invalid");
+
+	// Formats the header into buf as snprintf does, for logs.
+	int eth_format(char *buf, size_t len, const eth_hdr &hdr);
 };
 
 fio::ostream &operator<<(fio::ostream &os, const unet::eth_hdr &v);
@@ -0,0 +1,129 @@
+#include "icmp.h"
+#include "device.h"
+#include "log.h"
+
+#include <stdio.h>
+
+using namespace unet;
+
+icmp::icmp(device &dev, unet::ip &ip, const timer_wheel &clock, const icmp_config &cfg) :
+	dev(&dev),
+	ipv4(&ip),
+	clock(&clock),
+	cfg(cfg)
+{
+	size_t n = 1;
+	while (n < cfg.sources) { n <<= 1; }
+	sources.resize(n, bucket{0, cfg.burst * 1000, clock.now()});
+	all = bucket{0, (cfg.total / 10 + 1) * 1000, clock.now()};
+	ip.attach(IP_PROTO_ICMP, recv, this);
+}
+
+icmp::~icmp()
+{
+	ipv4->detach(IP_PROTO_ICMP);
+}
+
+bool icmp::take(bucket &b, uint64_t now, unsigned int rate, unsigned int burst)
+{
+	uint64_t tokens = b.tokens + (now - b.last) * rate;
+	b.tokens = std::min(tokens, uint64_t(burst) * 1000);
+	b.last = now;
+	if (b.tokens < 1000) { return false; }
+	b.tokens -= 1000;
+	return true;
+}
+
+bool icmp::allow(uint32_t saddr)
+{
+	uint64_t now = clock->now();
+	uint64_t h = saddr * 0x9e3779b97f4a7c15ull;
+	bucket &b = sources[(h >> 32) & (sources.size() - 1)];
+	if (b.addr != saddr) {
+		b = bucket{saddr, cfg.burst * 1000, now};
+	}
+	// Source first, so a source over its limit can't drain the total.
+	return take(b, now, cfg.rate, cfg.burst) &&
+		take(all, now, cfg.total, cfg.total / 10 + 1);
+}
+
+void icmp::echo(buffer &buf, ip4_hdr &hdr, icmp_hdr &msg)
+{
+	uint16_t from, to;
+	memcpy(&from, &msg.type, sizeof(from));
+	msg.type = ICMP_ECHOREPLY;
+	memcpy(&to, &msg.type, sizeof(to));
+	msg.check = csum_replace2(msg.check, from, to);
+
+	// Swapping the addresses leaves the header sum as it was.
+	uint32_t saddr = hdr.saddr;
+	hdr.saddr = hdr.daddr;
+	hdr.daddr = saddr;
+	hdr.set_ttl(UNET_IP4_DEFTTL);
+
+	uint8_t dmac[UNET_ETH_ALEN];
+	memcpy(dmac, buf.data() + offsetof(eth_hdr, smac), sizeof(dmac));
+
+	buf.truncate(UNET_ETH_HLEN + hdr.length());
+	buf.pull(UNET_ETH_HLEN);
+	buf.offload() = buffer_offload();
+	if (dev->transmit(buf, dmac, ETH_IP) >= 0) {
+		st.echo_replies++;
+	}
+}
+
+void icmp::recv(void *ctx, buffer &buf, ip4_hdr &hdr, const slice &payload)
+{
+	icmp &self = *static_cast<icmp *>(ctx);
+	self.st.received++;
+
+	if (payload.length() < UNET_ICMP_HLEN) {
+		self.st.bad++;
+		return;
+	}
+
+	icmp_hdr &msg = *reinterpret_cast<icmp_hdr *>(hdr.data + (hdr.hlen() - UNET_IP4_HLEN));
+	log_event(LOG_ICMP, &msg, UNET_ICMP_HLEN);
+	if (msg.type != ICMP_ECHO || msg.code != 0) {
+		self.st.ignored++;
+		return;
+	}
+
+	// Broadcast pings, requests with options to reverse, and reassembled
+	// requests too big to send back unfragmented all go unanswered.
+	unsigned int hoff = reinterpret_cast<uint8_t *>(&hdr) - buf.data();
+	if (hdr.daddr != self.ipv4->ipaddr() || hdr.hlen() != UNET_IP4_HLEN ||
+			hoff != UNET_ETH_HLEN || hdr.length() > UNET_ETH_DATA_LEN) {
+		self.st.ignored++;
+		return;
+	}
+
+	if (!buf.offload().csum_valid() && csum(payload.value(), payload.length()) != 0) {
+		self.st.bad++;
+		return;
+	}
+
+	if (!self.allow(hdr.saddr)) {
+		self.st.limited++;
+		return;
+	}
+
+	self.echo(buf, hdr, msg);
+}
+
+const char *unet::icmp_type_name(icmp_type type)
+{
+	switch (type) {
+#define X(name, val) case ICMP_##name: return #name;
+		UNET_ICMP_TYPE
+#undef X
+	}
+	return "(unknown)";
+}
+
+int unet::icmp_format(char *buf, size_t len, const icmp_hdr &hdr)
+{
+	return snprintf(buf, len, "icmp (%s code=%u id=%u seq=%u)",
+			icmp_type_name(static_cast<icmp_type>(hdr.type)),
+			hdr.code, ntoh16(hdr.id), ntoh16(hdr.seq));
+}
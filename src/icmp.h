@@ -0,0 +1,113 @@
+#ifndef UNET_ICMP_H
+#define UNET_ICMP_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "base.h"
+#include "slice.h"
+#include "buffer.h"
+#include "timer.h"
+#include "ip.h"
+
+#define UNET_ICMP_HLEN      8    /* Total octets in header. */
+
+#define UNET_ICMP_TYPE \
+	X(ECHOREPLY,      0)  /* Echo Reply */ \
+	X(DEST_UNREACH,   3)  /* Destination Unreachable */ \
+	X(SOURCE_QUENCH,  4)  /* Source Quench */ \
+	X(REDIRECT,       5)  /* Redirect (change route) */ \
+	X(ECHO,           8)  /* Echo Request */ \
+	X(TIME_EXCEEDED,  11) /* Time Exceeded */ \
+	X(PARAMETERPROB,  12) /* Parameter Problem */ \
+	X(TIMESTAMP,      13) /* Timestamp Request */ \
+	X(TIMESTAMPREPLY, 14) /* Timestamp Reply */ \
+
+namespace unet
+{
+	class device;
+
+	enum icmp_type : uint8_t
+	{
+#define X(name, val) ICMP_##name = val,
+		UNET_ICMP_TYPE
+#undef X
+	};
+
+	const char *icmp_type_name(icmp_type type);
+
+	struct icmp_hdr
+	{
+		uint8_t  type;
+		uint8_t  code;
+		uint16_t check;
+		uint16_t id;
+		uint16_t seq;
+		uint8_t  data[0];
+	} __attribute__((packed));
+
+	struct icmp_config
+	{
+		unsigned int rate = 1000;        /* replies per second to one source */
+		unsigned int burst = 100;        /* replies one source may bank */
+		unsigned int total = 100000;     /* replies per second to everyone */
+		unsigned int sources = 1024;     /* sources limited separately */
+	};
+
+	/**
+	 * Answers echo requests by turning the request frame into the reply and
+	 * sending it back out from the same buffer, so a ping costs a checksum
+	 * pass and a write. Replies are limited per source and in total by token
+	 * buckets; sources that share a bucket slot take it over from each
+	 * other, which the total limit still bounds.
+	 */
+	class icmp : private nocopy
+	{
+	public:
+		struct stats
+		{
+			size_t received;      /* messages delivered by ip */
+			size_t bad;           /* truncated or bad checksum */
+			size_t echo_replies;  /* replies sent */
+			size_t limited;       /* requests dropped by a rate limit */
+			size_t ignored;       /* messages not answered */
+		};
+
+		icmp(device &dev, unet::ip &ip, const timer_wheel &clock,
+				const icmp_config &cfg = icmp_config());
+		~icmp();
+
+		const stats &get_stats() const { return st; }
+
+	private:
+		struct bucket
+		{
+			uint32_t addr;
+			uint32_t tokens;      /* thousandths of a reply */
+			uint64_t last;
+		};
+
+		device *dev;
+		unet::ip *ipv4;
+		const timer_wheel *clock;
+		icmp_config cfg;
+		std::vector<bucket> sources;
+		bucket all;
+		stats st = {};
+
+		static void recv(void *ctx, buffer &buf, ip4_hdr &hdr, const slice &payload);
+
+		bool allow(uint32_t saddr);
+		bool take(bucket &b, uint64_t now, unsigned int rate, unsigned int burst);
+		void echo(buffer &buf, ip4_hdr &hdr, icmp_hdr &msg);
+	};
+
+	static_assert(sizeof(icmp_hdr) == UNET_ICMP_HLEN, "icmp_hdr size invalid");
+
+	// Formats the header into buf as snprintf does, for logs.
+	int icmp_format(char *buf, size_t len, const icmp_hdr &hdr);
+};
+
+#endif
+
@@ -10,7 +10,7 @@ namespace unet
 	class ilist
 	{
 	public:
-		using self_type = ilist<T>;
+		using self_type = ilist<T, Deleter>;
 		using pointer = T*;
 		using unique_ptr = std::unique_ptr<T, Deleter>;
 		using reference = T&;
@@ -81,7 +81,7 @@ namespace unet
 			iter_type operator--() noexcept { iter_type i = as_iter(); as_iter().move_prev(); return i; }
 			iter_type operator--(int _) noexcept { (void)_; as_iter().move_prev(); return as_iter(); }
 
-			friend class ilist<T>;
+			friend class ilist;
 		};
 
 		template <int dir>
@@ -236,6 +236,8 @@ namespace unet
 
 		void splice(reference before, self_type &other) noexcept { splice_dir<0>(before, other); }
 		void splice(iterator before, self_type &other) noexcept { splice_dir<0>(*before, other); }
+		void splice_front(self_type &other) noexcept { splice_dir<1>(head, other); }
+		void splice_back(self_type &other) noexcept { splice_dir<0>(head, other); }
 
 		unique_ptr take(pointer e) noexcept { return e->take(); }
 		unique_ptr take(reference e) noexcept { return take(&e); }
@@ -275,8 +277,8 @@ namespace unet
 
 namespace std
 {
-	template <class T>
-	void swap(unet::ilist<T> &lhs, unet::ilist<T> &rhs)
+	template <class T, class D>
+	void swap(unet::ilist<T, D> &lhs, unet::ilist<T, D> &rhs)
 	{
 		lhs.swap(rhs);
 	}
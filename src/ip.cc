@@ -0,0 +1,105 @@
+#include "ip.h"
+#include "fmt.h"
+#include "log.h"
+
+#include <stdio.h>
+
+using namespace unet;
+
+static inline bool is_local(uint32_t daddr, uint32_t addr)
+{
+	return daddr == addr || daddr == 0xffffffff;
+}
+
+static inline bool is_martian_source(uint32_t saddr)
+{
+	// Multicast (224/4) and limited broadcast never send.
+	return (saddr & hton32(0xf0000000)) == hton32(0xe0000000) || saddr == 0xffffffff;
+}
+
+void ip::attach(ip_proto proto, handler fn, void *ctx)
+{
+	protos[proto].fn = fn;
+	protos[proto].ctx = ctx;
+}
+
+void ip::detach(ip_proto proto)
+{
+	protos[proto].fn = nullptr;
+	protos[proto].ctx = nullptr;
+}
+
+void ip::deliver(buffer &buf, ip4_hdr &hdr, const slice &payload)
+{
+	const binding &b = protos[hdr.proto];
+	if (b.fn == nullptr) {
+		st.no_proto++;
+		return;
+	}
+	st.delivered++;
+	b.fn(b.ctx, buf, hdr, payload);
+}
+
+void ip::recv(buffer &frame, const slice &buf)
+{
+	st.received++;
+
+	// The one bounds check: everything after it reads within the header,
+	// and the payload handed on is cut to the length the header states.
+	size_t n = buf.length();
+	if (__builtin_expect(n < UNET_IP4_HLEN, 0)) {
+		st.bad_header++;
+		return;
+	}
+
+	unsigned int hoff = buf.value() - frame.data();
+	ip4_hdr &hdr = *reinterpret_cast<ip4_hdr *>(frame.data() + hoff);
+	log_event(LOG_IP, &hdr, UNET_IP4_HLEN);
+	unsigned int hlen = hdr.hlen();
+	unsigned int len = hdr.length();
+	if (__builtin_expect((hdr.ver() != 4) | (hlen < UNET_IP4_HLEN) | (len < hlen) | (len > n), 0)) {
+		st.bad_header++;
+		return;
+	}
+	if (__builtin_expect(!hdr.check_valid(), 0)) {
+		st.bad_checksum++;
+		return;
+	}
+	if (!is_local(hdr.daddr, addr) || is_martian_source(hdr.saddr)) {
+		st.not_local++;
+		return;
+	}
+	if (hdr.is_fragment()) {
+		st.fragments++;
+		// The frame may be gone once add returns, and hdr with it.
+		buffer::unique_ptr whole = reasm.add(frame, hdr, hoff);
+		if (whole) {
+			ip4_hdr &wh = *reinterpret_cast<ip4_hdr *>(whole->data() + hoff);
+			deliver(*whole, wh, slice(wh.data + (wh.hlen() - UNET_IP4_HLEN), wh.length() - wh.hlen()));
+		}
+		return;
+	}
+
+	deliver(frame, hdr, buf.sub(hlen, len - hlen));
+}
+
+const char *unet::ip_proto_name(ip_proto proto)
+{
+	switch (proto) {
+#define X(name, val) case IP_PROTO_##name: return #name;
+		UNET_IP_PROTO
+#undef X
+	}
+	return "(unknown)";
+}
+
+int unet::ip4_format(char *buf, size_t len, const ip4_hdr &hdr)
+{
+	return snprintf(buf, len, "ip (%s " UNET_IP4_FMT "->" UNET_IP4_FMT " len=%u ttl=%u id=%u%s)",
+			ip_proto_name(static_cast<ip_proto>(hdr.proto)),
+			UNET_IP4_ARG(hdr.saddr),
+			UNET_IP4_ARG(hdr.daddr),
+			hdr.length(), hdr.ttl, ntoh16(hdr.id),
+			hdr.is_fragment() ? " frag" : "");
+}
+
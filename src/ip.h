@@ -2,14 +2,50 @@
 #define UNET_IP_H
 
 #include <cstdint>
-
-#include <set>
+#include <cstddef>
 #include <cstring>
 
+#include "base.h"
+#include "slice.h"
+#include "host.h"
+#include "csum.h"
+#include "buffer.h"
+#include "timer.h"
+#include "reasm.h"
+
 #define UNET_IP4_HLEN       20   /* Total octets in header. */
+#define UNET_IP4_MAXHLEN    60   /* Max. octets in header with options. */
+#define UNET_IP4_DEFTTL     64   /* TTL of packets this host originates. */
+
+#define UNET_IP4_RF         0x8000 /* Reserved fragment flag */
+#define UNET_IP4_DF         0x4000 /* Don't fragment flag */
+#define UNET_IP4_MF         0x2000 /* More fragments flag */
+#define UNET_IP4_OFFMASK    0x1fff /* Mask for fragment offset */
+
+#define UNET_IP_PROTO \
+	X(ICMP,        1)   /* Internet Control Message Protocol */ \
+	X(IGMP,        2)   /* Internet Group Management Protocol */ \
+	X(IPIP,        4)   /* IPIP tunnels */ \
+	X(TCP,         6)   /* Transmission Control Protocol */ \
+	X(UDP,         17)  /* User Datagram Protocol */ \
+	X(IPV6,        41)  /* IPv6-in-IPv4 tunnelling */ \
+	X(GRE,         47)  /* Generic Routing Encapsulation */ \
+	X(ESP,         50)  /* Encapsulation Security Payload */ \
+	X(AH,          51)  /* Authentication Header */ \
+	X(SCTP,        132) /* Stream Control Transport Protocol */ \
+	X(UDPLITE,     136) /* UDP-Lite */ \
 
 namespace unet
 {
+	enum ip_proto : uint8_t
+	{
+#define X(name, val) IP_PROTO_##name = val,
+		UNET_IP_PROTO
+#undef X
+	};
+
+	const char *ip_proto_name(ip_proto proto);
+
 	struct ip4_hdr
 	{
 		uint8_t ver_ihl;
@@ -25,16 +61,100 @@ namespace unet
 		uint8_t data[0];
 
 		uint8_t ver() const { return ver_ihl >> 4; }
-		uint8_t ihl() const { return ver_ihl | 0xf; }
+		uint8_t ihl() const { return ver_ihl & 0xf; }
+		unsigned int hlen() const { return ihl() * 4u; }
+		unsigned int length() const { return ntoh16(len); }
+		bool is_fragment() const { return frag_off & hton16(UNET_IP4_MF|UNET_IP4_OFFMASK); }
+
+		bool check_valid() const { return csum(this, hlen()) == 0; }
+
+		void set_check()
+		{
+			check = 0;
+			check = csum(this, hlen());
+		}
+
+		// Field rewrites that patch the checksum instead of recomputing it.
+
+		void set_ttl(uint8_t val)
+		{
+			uint16_t from, to;
+			memcpy(&from, &ttl, sizeof(from));
+			ttl = val;
+			memcpy(&to, &ttl, sizeof(to));
+			check = csum_replace2(check, from, to);
+		}
+
+		void set_saddr(uint32_t val)
+		{
+			check = csum_replace4(check, saddr, val);
+			saddr = val;
+		}
+
+		void set_daddr(uint32_t val)
+		{
+			check = csum_replace4(check, daddr, val);
+			daddr = val;
+		}
 	} __attribute__((packed));
 
-	class ip
+	class ip : private nocopy
 	{
 	public:
-		void recv(const slice &buf);
+		/**
+		 * Protocol handlers get the validated header and the payload trimmed
+		 * to the length the header gives, so they need no bounds check on
+		 * either. Both lie within buf, behind the link header, and may be
+		 * rewritten by a handler that replies in place.
+		 */
+		using handler = void (*)(void *ctx, buffer &buf, ip4_hdr &hdr, const slice &payload);
+
+		struct stats
+		{
+			size_t received;      /* packets handed to recv */
+			size_t delivered;     /* packets passed to a protocol handler */
+			size_t bad_header;    /* truncated or malformed headers */
+			size_t bad_checksum;  /* header checksum mismatches */
+			size_t not_local;     /* destination is not this host */
+			size_t fragments;     /* fragments handed to reassembly */
+			size_t no_proto;      /* no handler for the protocol */
+		};
+
+		ip(uint32_t addr, timer_wheel &wheel, const ip4_reasm_config &cfg = ip4_reasm_config())
+			: reasm(wheel, cfg), addr(addr) {}
+
+		void attach(ip_proto proto, handler fn, void *ctx = nullptr);
+		void detach(ip_proto proto);
+
+		/**
+		 * Receives the packet pkt, which lies within buf. A fragment may
+		 * take buf out of its list to hold it for reassembly.
+		 */
+		void recv(buffer &buf, const slice &pkt);
+
+		uint32_t ipaddr() const { return addr; }
+		const stats &get_stats() const { return st; }
+		const ip4_reasm::stats &get_reasm_stats() const { return reasm.get_stats(); }
+
+	private:
+		struct binding
+		{
+			handler fn;
+			void *ctx;
+		};
+
+		void deliver(buffer &buf, ip4_hdr &hdr, const slice &payload);
+
+		binding protos[256] = {};
+		ip4_reasm reasm;
+		uint32_t addr;
+		stats st = {};
 	};
 
 	static_assert(sizeof(ip4_hdr) == UNET_IP4_HLEN, "ip4_hdr size invalid");
+
+	// Formats the fixed part of the header into buf as snprintf does, for logs.
+	int ip4_format(char *buf, size_t len, const ip4_hdr &hdr);
 };
 
 #endif
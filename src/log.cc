@@ -0,0 +1,328 @@
+#include "log.h"
+#include "error.h"
+#include "trace.h"
+#include "eth.h"
+#include "arp.h"
+#include "ip.h"
+#include "icmp.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace unet;
+
+#define LOG_FLUSH           (64 * 1024)   /* octets buffered before a write */
+#define LOG_IDLE_NS         1000000       /* logger sleep with nothing to do */
+
+static const char log_magic[8] = { 'U', 'N', 'E', 'T', 'L', 'O', 'G', '1' };
+
+thread_local log_ring *log_ring::current = nullptr;
+
+const char *unet::log_type_name(log_type type)
+{
+	switch (type) {
+#define X(name, str) case LOG_##name: return str;
+		UNET_LOG_TYPE
+#undef X
+	case LOG_SKIP:
+	case LOG_TYPES:
+		break;
+	}
+	return "(unknown)";
+}
+
+static void write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	size_t n = 0;
+	while (n < len) {
+		ssize_t rc = ::write(fd, p + n, len - n);
+		if (rc < 0) {
+			if (errno == EINTR) { continue; }
+			return;
+		}
+		n += rc;
+	}
+}
+
+void unet::log_format(std::string &out, const log_file_hdr &clock, const log_record &rec, const uint8_t *data)
+{
+	char buf[512];
+	int64_t ticks = (int64_t)(rec.ts - clock.ticks);
+	uint64_t ns = clock.ns + (int64_t)(ticks / clock.ticks_per_ns);
+	out.append(buf, snprintf(buf, sizeof(buf), "%llu.%09llu %u %s: ",
+			(unsigned long long)(ns / 1000000000),
+			(unsigned long long)(ns % 1000000000),
+			rec.ring,
+			log_type_name(static_cast<log_type>(rec.type))));
+
+	// Anything cut too short for its type is printed in hex instead.
+	int n = 0;
+	switch (rec.type) {
+	case LOG_ETH_RX:
+	case LOG_ETH_TX:
+		if (rec.len >= UNET_ETH_HLEN) {
+			n = eth_format(buf, sizeof(buf), *reinterpret_cast<const eth_hdr *>(data));
+		}
+		break;
+	case LOG_ARP:
+		if (rec.len >= UNET_ARP_HLEN + UNET_ARP_DLEN) {
+			n = arp_format(buf, sizeof(buf), *reinterpret_cast<const arp_hdr *>(data));
+		}
+		break;
+	case LOG_IP:
+		if (rec.len >= UNET_IP4_HLEN) {
+			n = ip4_format(buf, sizeof(buf), *reinterpret_cast<const ip4_hdr *>(data));
+		}
+		break;
+	case LOG_ICMP:
+		if (rec.len >= UNET_ICMP_HLEN) {
+			n = icmp_format(buf, sizeof(buf), *reinterpret_cast<const icmp_hdr *>(data));
+		}
+		break;
+	}
+
+	if (n > 0) {
+		out.append(buf, std::min((size_t)n, sizeof(buf) - 1));
+	}
+	else {
+		for (unsigned int i = 0; i < rec.len; i++) {
+			out.append(buf, snprintf(buf, sizeof(buf), "%02x", data[i]));
+		}
+	}
+	out.push_back('\n');
+}
+
+std::error_code unet::log_decode(const char *path, int out)
+{
+	int fd = ::open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) { return std::error_code(errno, std::system_category()); }
+
+	std::vector<uint8_t> data;
+	uint8_t chunk[65536];
+	for (;;) {
+		ssize_t rc = ::read(fd, chunk, sizeof(chunk));
+		if (rc < 0) {
+			if (errno == EINTR) { continue; }
+			int err = errno;
+			::close(fd);
+			return std::error_code(err, std::system_category());
+		}
+		if (rc == 0) { break; }
+		data.insert(data.end(), chunk, chunk + rc);
+	}
+	::close(fd);
+
+	log_file_hdr clock;
+	if (data.size() < sizeof(clock)) { return error::invalid_log; }
+	memcpy(&clock, data.data(), sizeof(clock));
+	if (memcmp(clock.magic, log_magic, sizeof(log_magic)) != 0 || clock.ticks_per_ns <= 0) {
+		return error::invalid_log;
+	}
+
+	// A file cut short by a crash ends at its last whole record.
+	std::string text;
+	size_t off = sizeof(clock);
+	while (off + sizeof(log_record) <= data.size()) {
+		auto *rec = reinterpret_cast<const log_record *>(&data[off]);
+		if (rec->size < sizeof(log_record) + rec->len || rec->size % 8 != 0) {
+			write_all(out, text.data(), text.size());
+			return error::invalid_log;
+		}
+		if (off + rec->size > data.size()) { break; }
+		log_format(text, clock, *rec, reinterpret_cast<const uint8_t *>(rec + 1));
+		if (text.size() >= LOG_FLUSH) {
+			write_all(out, text.data(), text.size());
+			text.clear();
+		}
+		off += rec->size;
+	}
+	write_all(out, text.data(), text.size());
+	return std::error_code();
+}
+
+log_ring::log_ring(unsigned int id, uint32_t types, size_t size) :
+	id(id),
+	types(types)
+{
+	size_t n = 4096;
+	while (n < size) { n <<= 1; }
+	mem.reset(new uint8_t[n]);
+	mask = n - 1;
+}
+
+void log_ring::push(log_type type, const void *data, unsigned int len)
+{
+	// Records are 8-aligned and never wrap, as in capture_ring.
+	len = std::min(len, (unsigned int)UNET_LOG_MAXLEN);
+	size_t need = (sizeof(log_record) + len + 7) & ~(size_t)7;
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	size_t off = h & mask;
+	size_t gap = mask + 1 - off;
+	size_t total = need > gap ? gap + need : need;
+	if (total > mask + 1 - (h - t)) {
+		drops++;
+		return;
+	}
+
+	if (need > gap) {
+		if (gap >= sizeof(log_record)) {
+			auto *skip = reinterpret_cast<log_record *>(&mem[off]);
+			skip->size = gap;
+			skip->type = LOG_SKIP;
+		}
+		h += gap;
+		off = 0;
+	}
+
+	auto *r = reinterpret_cast<log_record *>(&mem[off]);
+	r->size = need;
+	r->len = len;
+	r->type = type;
+	r->ring = id;
+	r->ts = trace_clock();
+	memcpy(r + 1, data, len);
+	logged++;
+	head.store(h + need, std::memory_order_release);
+}
+
+template <typename Fn>
+size_t log_ring::drain(Fn fn)
+{
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	size_t n = 0;
+
+	while (t != h) {
+		size_t off = t & mask;
+		size_t gap = mask + 1 - off;
+		if (gap < sizeof(log_record)) {
+			t += gap;
+			continue;
+		}
+		auto *r = reinterpret_cast<const log_record *>(&mem[off]);
+		if (r->type != LOG_SKIP) {
+			fn(*r, reinterpret_cast<const uint8_t *>(r + 1));
+			n++;
+		}
+		t += r->size;
+	}
+	tail.store(t, std::memory_order_release);
+	return n;
+}
+
+logger::logger(const log_config &cfg, int out) :
+	cfg(cfg),
+	out(out)
+{
+	struct timespec ts;
+	memcpy(clock.magic, log_magic, sizeof(clock.magic));
+	clock.ticks_per_ns = trace_clock_rate();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	clock.ticks = trace_clock();
+	clock.ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	buf.reserve(LOG_FLUSH + 4096);
+}
+
+logger::~logger()
+{
+	stop();
+}
+
+std::error_code logger::start()
+{
+	if (running.load()) { return std::error_code(); }
+
+	if (!cfg.path.empty()) {
+		fd = ::open(cfg.path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if (fd < 0) { return std::error_code(errno, std::system_category()); }
+		const uint8_t *p = reinterpret_cast<const uint8_t *>(&clock);
+		buf.insert(buf.end(), p, p + sizeof(clock));
+	}
+
+	running.store(true);
+	th = std::thread(&logger::run, this);
+	return std::error_code();
+}
+
+void logger::stop()
+{
+	if (running.exchange(false)) {
+		th.join();
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+log_ring &logger::attach()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	rings.emplace_back(new log_ring(rings.size(), cfg.types, cfg.ring));
+	return *rings.back();
+}
+
+void logger::collect(counter_set &set) const
+{
+	size_t logged = 0, dropped = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto &r : rings) {
+			logged += r->logged;
+			dropped += r->drops;
+		}
+	}
+	set.add("log.records", logged);
+	set.add("log.dropped", dropped);
+}
+
+void logger::run()
+{
+	while (running.load(std::memory_order_relaxed)) {
+		if (!drain()) {
+			struct timespec ts = { 0, LOG_IDLE_NS };
+			nanosleep(&ts, nullptr);
+		}
+	}
+	drain();
+}
+
+bool logger::drain()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	size_t total = 0;
+
+	for (auto &r : rings) {
+		total += r->drain([&](const log_record &rec, const uint8_t *data) {
+			if (fd >= 0) {
+				const uint8_t *p = reinterpret_cast<const uint8_t *>(&rec);
+				buf.insert(buf.end(), p, p + sizeof(rec) + rec.len);
+				buf.resize(buf.size() + rec.size - sizeof(rec) - rec.len, 0);
+			}
+			else {
+				log_format(text, clock, rec, data);
+			}
+			if (buf.size() + text.size() >= LOG_FLUSH) { flush_out(); }
+		});
+	}
+	flush_out();
+	return total > 0;
+}
+
+void logger::flush_out()
+{
+	if (fd >= 0) {
+		write_all(fd, buf.data(), buf.size());
+	}
+	else {
+		write_all(out, text.data(), text.size());
+	}
+	buf.clear();
+	text.clear();
+}
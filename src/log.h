@@ -0,0 +1,178 @@
+#ifndef UNET_LOG_H
+#define UNET_LOG_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <system_error>
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+
+#include "base.h"
+#include "stats.h"
+
+#define UNET_LOG_MAXLEN     64   /* Max. octets of header kept per record */
+
+#define UNET_LOG_TYPE \
+	X(ETH_RX, "eth.rx") /* Ethernet header of every frame received */ \
+	X(ETH_TX, "eth.tx") /* Ethernet header of every frame sent */ \
+	X(ARP,    "arp")    /* ARP header and IPv4 addresses */ \
+	X(IP,     "ip")     /* fixed IPv4 header, ahead of the checks */ \
+	X(ICMP,   "icmp")   /* ICMP header */ \
+
+namespace unet
+{
+	enum log_type : uint8_t
+	{
+		LOG_SKIP = 0,
+#define X(name, str) LOG_##name,
+		UNET_LOG_TYPE
+#undef X
+		LOG_TYPES
+	};
+
+	const char *log_type_name(log_type type);
+
+	// Mask of every type, for log_config::types.
+	constexpr uint32_t log_all = (1u << LOG_TYPES) - 2;
+
+	/**
+	 * One logged header, followed by len octets of it. The same layout is
+	 * used in the rings and in binary log files.
+	 */
+	struct log_record
+	{
+		uint32_t size;       /* octets to the next record, 8-aligned */
+		uint16_t len;        /* octets of header that follow */
+		uint8_t  type;       /* log_type, LOG_SKIP to skip to the ring start */
+		uint8_t  ring;       /* thread that logged it */
+		uint64_t ts;         /* trace_clock ticks */
+	};
+
+	/**
+	 * Start of a binary log file, which is followed by records. The
+	 * clock pair maps record ticks to the time of day.
+	 */
+	struct log_file_hdr
+	{
+		char     magic[8];     /* "UNETLOG1" */
+		double   ticks_per_ns;
+		uint64_t ticks;        /* trace_clock when the file was started */
+		uint64_t ns;           /* ns since the epoch at the same moment */
+	};
+
+	struct log_config
+	{
+		std::string path;                 /* binary log file, empty to render text to out */
+		uint32_t types = log_all;         /* bit per log_type logged */
+		size_t ring = 4 << 20;            /* octets of ring per thread */
+	};
+
+	class logger;
+
+	/**
+	 * Single-producer ring between one thread of the stack and the logger.
+	 * A record is a type, a timestamp and the raw header, copied in with
+	 * no formatting at all; a record that doesn't fit is counted and
+	 * dropped rather than waited for.
+	 */
+	class log_ring : private nocopy, private nomove
+	{
+		friend class logger;
+
+		unsigned int id;
+		uint32_t types;
+		std::unique_ptr<uint8_t[]> mem;
+		size_t mask;
+
+		// Kept a cache line apart so producer and logger don't share one.
+		std::atomic<size_t> head{0};   /* written by the producer */
+		size_t logged = 0;
+		size_t drops = 0;
+		uint8_t _pad[UNET_CACHELINE];
+		std::atomic<size_t> tail{0};   /* written by the logger */
+
+		log_ring(unsigned int id, uint32_t types, size_t size);
+
+		template <typename Fn>
+		size_t drain(Fn fn);
+
+	public:
+		// The ring of the calling thread, if it logs.
+		static thread_local log_ring *current;
+
+		bool wants(log_type type) const { return types & (1u << type); }
+		void push(log_type type, const void *data, unsigned int len);
+
+		size_t dropped() const { return drops; }
+	};
+
+	/**
+	 * Logs a header from the packet path. Threads without a ring pay a
+	 * thread-local load for it.
+	 */
+	inline void log_event(log_type type, const void *data, unsigned int len)
+	{
+		log_ring *r = log_ring::current;
+		if (__builtin_expect(r != nullptr, 0) && r->wants(type)) {
+			r->push(type, data, len);
+		}
+	}
+
+	/**
+	 * Formats one record as a line of text: the time of day, the thread,
+	 * and the header as the layer that owns it would print it.
+	 */
+	void log_format(std::string &out, const log_file_hdr &clock, const log_record &rec, const uint8_t *data);
+
+	/**
+	 * Renders a binary log file as text to out.
+	 */
+	std::error_code log_decode(const char *path, int out = STDOUT_FILENO);
+
+	/**
+	 * Drains the rings of every logging thread from a background thread,
+	 * either formatting the records as text to out or appending them as
+	 * they are to a binary file, for log_decode to format later. Rings are
+	 * drained in turn, so lines are in order per thread, not overall.
+	 */
+	class logger : private nocopy, private nomove
+	{
+		log_config cfg;
+		int out;
+		log_file_hdr clock;
+		std::vector<std::unique_ptr<log_ring>> rings;
+		mutable std::mutex lock;
+		std::thread th;
+		std::atomic<bool> running{false};
+
+		int fd = -1;
+		std::vector<uint8_t> buf;
+		std::string text;
+
+		void run();
+		bool drain();
+		void flush_out();
+
+	public:
+		explicit logger(const log_config &cfg, int out = STDOUT_FILENO);
+		~logger();
+
+		std::error_code start();
+		void stop();
+
+		/**
+		 * Returns a new ring for one thread to log to, through
+		 * log_ring::current. Rings live as long as the logger.
+		 */
+		log_ring &attach();
+
+		void collect(counter_set &out) const;
+	};
+}
+
+#endif
@@ -1,25 +1,353 @@
 #include <iostream>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
 
-#include "device.h"
+#include "device_tun.h"
+#include "device_packet.h"
+#include "device_pcap.h"
+#include "pool.h"
+#include "thread.h"
+#include "capture.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+#include "vlan.h"
+
+struct vlan_spec
+{
+	uint16_t vid;
+	uint16_t svid;
+	std::string addr;
+	std::unique_ptr<unet::arp_cache> cache;   /* shared by every queue */
+};
+
+static void
+rx_thread(unet::device &dev, unet::buffer_pool &pool, unet::arp_cache &cache,
+		std::vector<vlan_spec> &vlans, unet::stats_registry &reg, unet::logger *logs, int cpu)
+{
+	std::error_code ec;
+
+	if (logs) {
+		unet::log_ring::current = &logs->attach();
+	}
+
+	if (cpu >= 0) {
+		ec = unet::pin_thread(cpu);
+		if (ec) {
+			fio::err() << "failed to pin rx thread: " << ec << fio::endl;
+			return;
+		}
+	}
+
+	unet::eth eth(dev, cache);
+	std::unique_ptr<unet::vlan_demux> demux;
+	if (!vlans.empty()) {
+		demux.reset(new unet::vlan_demux(dev, eth));
+		for (auto &v : vlans) {
+			ec = demux->add(v.vid, v.svid, v.addr.c_str(), nullptr, *v.cache);
+			if (ec) {
+				fio::err() << "failed to add vlan " << v.vid << ": " << ec << fio::endl;
+				return;
+			}
+		}
+	}
+	unsigned int dev_stats = reg.add(dev);
+	unsigned int eth_stats = reg.add(eth);
+	unsigned int vlan_stats = demux ? reg.add(*demux) : 0;
+
+	ec = dev.loop_rx(eth, pool);
+	if (ec && ec != unet::error::end_of_replay) {
+		fio::err() << "failed to read from device: " << ec << fio::endl;
+	}
+
+	if (demux) {
+		reg.remove(vlan_stats);
+	}
+	reg.remove(eth_stats);
+	reg.remove(dev_stats);
+}
+
+static void
+collect_pool(void *ctx, unet::counter_set &out)
+{
+	auto st = static_cast<unet::buffer_pool *>(ctx)->get_stats();
+	out.add("pool.total", st.total);
+	out.add("pool.in_use", st.in_use);
+	out.add("pool.high_water", st.high_water);
+	out.add("pool.misses", st.misses);
+}
+
+static std::vector<int>
+parse_cpus(char *list)
+{
+	std::vector<int> cpus;
+	for (char *tok = strtok(list, ","); tok; tok = strtok(nullptr, ",")) {
+		cpus.push_back(atoi(tok));
+	}
+	return cpus;
+}
+
+// Parses "[svid.]vid=addr".
+static bool
+parse_vlan(const char *arg, vlan_spec &v)
+{
+	const char *eq = strchr(arg, '=');
+	if (eq == nullptr || eq[1] == '\0') { return false; }
+
+	char *end;
+	unsigned long a = strtoul(arg, &end, 10);
+	unsigned long b = 0;
+	if (*end == '.') {
+		b = a;
+		a = strtoul(end + 1, &end, 10);
+	}
+	if (end != eq || a == 0 || a >= UNET_VLAN_N_VID || b >= UNET_VLAN_N_VID) { return false; }
+
+	v.vid = a;
+	v.svid = b;
+	v.addr = eq + 1;
+	v.cache.reset(new unet::arp_cache);
+	return true;
+}
+
+static std::error_code
+open_tun(std::vector<std::unique_ptr<unet::device>> &devs, unsigned int queues, unsigned int flags)
+{
+	std::error_code ec;
+
+	if (queues > 1) {
+		flags |= unet::DEVICE_MULTI_QUEUE;
+	}
+
+	auto *first = new unet::tun_device;
+	devs.emplace_back(first);
+
+	ec = first->open("10.0.0.4", "10.0.0.0/24", "00:0c:29:6d:50:25", "", flags);
+	if (ec) { return ec; }
+
+	for (unsigned int i = 1; i < queues; i++) {
+		auto *dev = new unet::tun_device;
+		devs.emplace_back(dev);
+		ec = dev->attach(*first);
+		if (ec) { return ec; }
+	}
+	return ec;
+}
+
+static std::error_code
+open_packet(std::vector<std::unique_ptr<unet::device>> &devs, const char *ifname)
+{
+	auto *dev = new unet::packet_device;
+	devs.emplace_back(dev);
+	return dev->open(ifname, "10.0.0.4", "00:0c:29:6d:50:25");
+}
+
+static std::error_code
+open_pcap(std::vector<std::unique_ptr<unet::device>> &devs, const char *path, const unet::pcap_config &cfg)
+{
+	auto *dev = new unet::pcap_device;
+	devs.emplace_back(dev);
+	return dev->open(path, "10.0.0.4", "00:0c:29:6d:50:25", cfg);
+}
+
+static std::string
+report_slowest(void *ctx)
+{
+	return static_cast<unet::trace_set *>(ctx)->slowest();
+}
+
+static void
+print_replay(const unet::pcap_device &dev, std::chrono::steady_clock::duration elapsed)
+{
+	auto &st = dev.get_stats();
+	uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	if (us == 0) { us = 1; }
+
+	fio::out() << "rx " << st.rx_frames << " frames " << st.rx_bytes << " bytes, "
+		<< "tx " << st.tx_frames << " frames " << st.tx_bytes << " bytes in "
+		<< us << " us: " << st.rx_frames * 1000000 / us << " pps" << fio::endl;
+}
 
 int
-main(void)
+main(int argc, char **argv)
 {
-	unet::device dev;
+	unsigned int queues = 1;
+	std::vector<int> cpus;
+	const char *ifname = nullptr;
+	bool offload = false;
+	bool uring = false;
+	unet::capture_config capcfg;
+	const char *filter = nullptr;
+	const char *replay = nullptr;
+	const char *stats_path = nullptr;
+	unet::trace_config tcfg;
+	bool trace = false;
+	unet::pcap_config pcfg;
+	unet::log_config lcfg;
+	bool verbose = false;
+	std::vector<vlan_spec> vlans;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "q:c:oui:w:s:C:W:F:r:PL:T:S:t:k:vl:D:V:")) != -1) {
+		switch (ch) {
+		case 'q': queues = strtoul(optarg, nullptr, 10); break;
+		case 'c': cpus = parse_cpus(optarg); break;
+		case 'o': offload = true; break;
+		case 'u': uring = true; break;
+		case 'i': ifname = optarg; break;
+		case 'w': capcfg.path = optarg; break;
+		case 's': capcfg.snaplen = strtoul(optarg, nullptr, 10); break;
+		case 'C': capcfg.rotate = strtoull(optarg, nullptr, 10) * 1000000; break;
+		case 'W': capcfg.files = strtoul(optarg, nullptr, 10); break;
+		case 'F': filter = optarg; break;
+		case 'r': replay = optarg; break;
+		case 'P': pcfg.paced = true; break;
+		case 'L': pcfg.loops = strtoul(optarg, nullptr, 10); break;
+		case 'T': pcfg.tx_path = optarg; break;
+		case 'S': stats_path = optarg; break;
+		case 't': trace = true; tcfg.sample = strtoul(optarg, nullptr, 10); break;
+		case 'k': tcfg.slowest = strtoul(optarg, nullptr, 10); break;
+		case 'v': verbose = true; break;
+		case 'V':
+			vlans.emplace_back();
+			if (!parse_vlan(optarg, vlans.back())) {
+				fio::err() << "invalid vlan: " << optarg << fio::endl;
+				return 1;
+			}
+			break;
+		case 'l': verbose = true; lcfg.path = optarg; break;
+		case 'D': {
+			auto ec = unet::log_decode(optarg);
+			if (ec) {
+				fio::err() << "failed to decode log: " << ec << fio::endl;
+				return 1;
+			}
+			return 0;
+		}
+		default:
+			fio::err() << "usage: unet [-o|-u] [-q queues] [-c cpu,...] [-i ifname] [-S socket] [-t 1-in-N [-k slowest]] [-v|-l file]" << fio::endl;
+			fio::err() << "            [-V [svid.]vid=addr ...]" << fio::endl;
+			fio::err() << "            [-w file [-s snaplen] [-C MB [-W files]] [-F bpf-file]]" << fio::endl;
+			fio::err() << "       unet -r file [-P] [-L loops] [-T file] [-w file ...]" << fio::endl;
+			fio::err() << "       unet -D file" << fio::endl;
+			return 1;
+		}
+	}
+	if (filter) {
+		auto ec = capcfg.filter.load_file(filter);
+		if (ec) {
+			fio::err() << "failed to load filter: " << ec << fio::endl;
+			return 1;
+		}
+	}
+	if (queues == 0) { queues = 1; }
+	if (ifname || replay) { offload = false; }
+
+	// The pool must outlive the devices, which may hold buffers from it.
+	unet::buffer_pool pool(offload ? UNET_GSO_FRAME_LEN : 2048, offload ? 32 : 256);
+	std::vector<std::unique_ptr<unet::device>> devs;
 	std::error_code ec;
 
-	ec = dev.open("10.0.0.4", "10.0.0.0/24", "00:0c:29:6d:50:25");
+	// Counters are dumped to stdout on SIGUSR1, and to anyone who connects
+	// to the socket if one was given. This runs before any other thread
+	// starts so they all inherit the blocked signal. Sources are declared
+	// ahead of the server, which can take a snapshot until it is destroyed.
+	std::unique_ptr<unet::trace_set> traces;
+	std::unique_ptr<unet::logger> logs;
+	unet::stats_registry reg;
+	unet::stats_server server(reg);
+	reg.add(collect_pool, &pool);
+	if (trace) {
+		traces.reset(new unet::trace_set(tcfg));
+		reg.add(*traces);
+		server.set_report(report_slowest, traces.get());
+	}
+	ec = server.start(stats_path);
 	if (ec) {
-		fio::err() << "failed to open device: " << ec << fio::endl;
+		fio::err() << "failed to start stats server: " << ec << fio::endl;
 		return 1;
 	}
 
-	unet::eth eth;
-	ec = dev.loop_rx(eth);
+	// Protocol headers are logged raw from the packet path and formatted,
+	// or written to a file for -D, by the logger's own thread.
+	if (verbose) {
+		logs.reset(new unet::logger(lcfg));
+		reg.add(*logs);
+		ec = logs->start();
+		if (ec) {
+			fio::err() << "failed to start logger: " << ec << fio::endl;
+			return 1;
+		}
+	}
+
+	if (replay) {
+		ec = open_pcap(devs, replay, pcfg);
+	}
+	else if (ifname) {
+		ec = open_packet(devs, ifname);
+	}
+	else {
+		unsigned int flags = 0;
+		if (offload) {
+			flags |= unet::DEVICE_VNET_HDR;
+		}
+		if (uring) {
+			flags |= unet::DEVICE_IO_URING;
+		}
+		ec = open_tun(devs, queues, flags);
+	}
 	if (ec) {
-		fio::err() << "failed to read from device: " << ec << fio::endl;
+		fio::err() << "failed to open device: " << ec << fio::endl;
 		return 1;
 	}
-}
 
+	std::unique_ptr<unet::capture> cap;
+	if (!capcfg.path.empty()) {
+		cap.reset(new unet::capture(capcfg));
+		for (auto &dev : devs) {
+			dev->set_capture(&cap->attach());
+		}
+		ec = cap->start();
+		if (ec) {
+			fio::err() << "failed to start capture: " << ec << fio::endl;
+			return 1;
+		}
+	}
+
+	if (traces) {
+		for (auto &dev : devs) {
+			dev->set_tracer(&traces->attach());
+		}
+	}
+
+	unet::arp_cache cache;
+	std::vector<std::thread> threads;
+	auto started = std::chrono::steady_clock::now();
+
+	for (unsigned int i = 0; i < devs.size(); i++) {
+		int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+		threads.emplace_back(rx_thread, std::ref(*devs[i]), std::ref(pool), std::ref(cache),
+				std::ref(vlans), std::ref(reg), logs.get(), cpu);
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	if (logs) {
+		logs->stop();
+	}
+	if (replay) {
+		print_replay(static_cast<unet::pcap_device &>(*devs[0]), std::chrono::steady_clock::now() - started);
+		if (traces) {
+			unet::counter_set set;
+			traces->collect(set);
+			fio::out() << set.format() << traces->slowest() << fio::endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include "pool.h"
+
+#include <new>
+#include <stdlib.h>
+
+using namespace unet;
+
+#define UNET_POOL_ALIGN 64
+
+thread_local buffer_cache *buffer_cache::current = nullptr;
+
+void buffer_delete::operator()(buffer *buf) const noexcept
+{
+	if (buf->pool) { buf->pool->release(buf); }
+	else { delete buf; }
+}
+
+buffer_pool::buffer_pool(unsigned int size, unsigned int per_slab, size_t max, unsigned int headroom) :
+	size(size),
+	headroom(headroom),
+	stride((sizeof(buffer) + headroom + size + UNET_POOL_ALIGN - 1) & ~(UNET_POOL_ALIGN - 1)),
+	per_slab(per_slab ? per_slab : 1),
+	max(max),
+	st{0, 0, 0, 0}
+{
+}
+
+buffer_pool::~buffer_pool()
+{
+	// Unlink without invoking the deleter, which would put them right back.
+	while (!free.is_empty()) {
+		(void)free.take_front().release();
+	}
+	for (void *slab : slabs) {
+		::free(slab);
+	}
+}
+
+bool buffer_pool::grow()
+{
+	if (max && st.total + per_slab > max) { return false; }
+
+	uint8_t *slab = static_cast<uint8_t *>(aligned_alloc(UNET_POOL_ALIGN, (size_t)stride * per_slab));
+	if (slab == nullptr) { return false; }
+	slabs.push_back(slab);
+
+	for (unsigned int i = 0; i < per_slab; i++) {
+		buffer *buf = new(slab + (size_t)i * stride) buffer(headroom + size, this);
+		buf->reserve(headroom);
+		free.push_back(*buf);
+	}
+	st.total += per_slab;
+	return true;
+}
+
+unsigned int buffer_pool::acquire(buffer_list &list, unsigned int n)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		if (free.is_empty()) {
+			st.misses++;
+			if (!grow()) { break; }
+		}
+		list.push_back(free.front());
+	}
+
+	st.in_use += i;
+	if (st.in_use > st.high_water) { st.high_water = st.in_use; }
+	return i;
+}
+
+void buffer_pool::give(buffer_list &list, unsigned int n)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (unsigned int i = 0; i < n; i++) {
+		free.push_front(list.back());
+	}
+	st.in_use -= n;
+}
+
+buffer *buffer_pool::acquire()
+{
+	buffer_cache *cache = buffer_cache::current;
+	if (cache && &cache->pool == this) { return cache->acquire(); }
+
+	buffer_list tmp;
+	if (acquire(tmp, 1) == 0) { return nullptr; }
+	return tmp.take_front().release();
+}
+
+void buffer_pool::recycle(buffer *buf)
+{
+	buf->reset();
+	buf->ptr = buf->buf;
+	buf->cap = headroom + size;
+	buf->reserve(headroom);
+}
+
+void buffer_pool::release(buffer *buf)
+{
+	buffer_cache *cache = buffer_cache::current;
+	if (cache && &cache->pool == this) {
+		cache->release(buf);
+		return;
+	}
+
+	recycle(buf);
+
+	std::lock_guard<std::mutex> guard(lock);
+	free.push_front(*buf);
+	st.in_use--;
+}
+
+buffer_pool::stats buffer_pool::get_stats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return st;
+}
+
+buffer_cache::buffer_cache(buffer_pool &pool, unsigned int batch) :
+	pool(pool),
+	batch(batch ? batch : 1),
+	prev(current)
+{
+	current = this;
+}
+
+buffer_cache::~buffer_cache()
+{
+	current = prev;
+	pool.give(list, count);
+}
+
+buffer *buffer_cache::acquire()
+{
+	if (count == 0) {
+		count = pool.acquire(list, batch);
+		if (count == 0) { return nullptr; }
+	}
+	count--;
+	return list.take_front().release();
+}
+
+unsigned int buffer_cache::acquire(buffer_list &out, unsigned int n)
+{
+	unsigned int i = 0;
+	for (; i < n && count > 0; i++, count--) {
+		out.push_back(list.front());
+	}
+
+	// Whatever the cache can't cover comes from the pool in one batch.
+	if (i < n) {
+		i += pool.acquire(out, n - i);
+	}
+	return i;
+}
+
+void buffer_cache::release(buffer *buf)
+{
+	pool.recycle(buf);
+	list.push_front(*buf);
+	if (++count > batch * 2) {
+		pool.give(list, batch);
+		count -= batch;
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef UNET_POOL_H
+#define UNET_POOL_H
+
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+#include "base.h"
+#include "buffer.h"
+
+namespace unet
+{
+	class buffer_cache;
+
+	/**
+	 * Slab allocator for fixed-size buffers. Buffers are carved out of slabs
+	 * that are allocated on demand and never returned to the system until the
+	 * pool is destroyed. Released buffers go back on an intrusive free list
+	 * and are not cleared when reused. Every buffer holds size octets of data
+	 * behind headroom octets left free for headers, so a frame read into one
+	 * or built in one can be tagged or encapsulated without a copy.
+	 */
+	class buffer_pool : private nocopy, private nomove
+	{
+	public:
+		struct stats
+		{
+			size_t total;      /* buffers carved from slabs */
+			size_t in_use;     /* buffers not on the shared free list */
+			size_t high_water; /* peak value of in_use */
+			size_t misses;     /* acquires that found the free list empty */
+		};
+
+		buffer_pool(unsigned int size, unsigned int per_slab = 256, size_t max = 0,
+				unsigned int headroom = UNET_HEADROOM);
+		~buffer_pool();
+
+		unsigned int buffer_size() const { return size; }
+		unsigned int buffer_headroom() const { return headroom; }
+
+		buffer *acquire();
+		unsigned int acquire(buffer_list &list, unsigned int n);
+		void release(buffer *buf);
+
+		buffer::unique_ptr make() { return buffer::unique_ptr(acquire()); }
+
+		stats get_stats();
+
+	private:
+		friend class buffer_cache;
+
+		std::mutex lock;
+		buffer_list free;
+		std::vector<void *> slabs;
+		unsigned int size;
+		unsigned int headroom;
+		unsigned int stride;
+		unsigned int per_slab;
+		size_t max;
+		stats st;
+
+		bool grow();
+		void recycle(buffer *buf);
+		void give(buffer_list &list, unsigned int n);
+	};
+
+	/**
+	 * Thread-local front end for a buffer_pool. While a cache is alive, all
+	 * acquires and releases against its pool from the constructing thread are
+	 * served from a small private list, and the shared list is only locked
+	 * to move buffers in batches.
+	 */
+	class buffer_cache : private nocopy, private nomove
+	{
+		friend class buffer_pool;
+
+		buffer_pool &pool;
+		buffer_list list;
+		unsigned int count = 0;
+		unsigned int batch;
+		buffer_cache *prev;
+
+		static thread_local buffer_cache *current;
+
+	public:
+		explicit buffer_cache(buffer_pool &pool, unsigned int batch = 32);
+		~buffer_cache();
+
+		buffer *acquire();
+		unsigned int acquire(buffer_list &list, unsigned int n);
+		void release(buffer *buf);
+
+		unsigned int length() const { return count; }
+	};
+}
+
+#endif
+
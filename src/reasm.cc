@@ -0,0 +1,264 @@
+#include "reasm.h"
+#include "ip.h"
+#include "pool.h"
+
+#include <cstring>
+#include <sys/random.h>
+
+using namespace unet;
+
+#define UNET_IP4_REASM_END  0x10000   /* Past any offset a datagram can use */
+
+static uint64_t reasm_seed(const void *salt)
+{
+	uint64_t seed;
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+		seed = coarse_clock_ms() ^ reinterpret_cast<uintptr_t>(salt);
+	}
+	return seed | 1;
+}
+
+ip4_reasm::ip4_reasm(timer_wheel &wheel, const ip4_reasm_config &cfg) :
+	wheel(wheel),
+	cfg(cfg),
+	seed(reasm_seed(this))
+{
+	if (this->cfg.queues == 0) { this->cfg.queues = 1; }
+	if (this->cfg.frags == 0) { this->cfg.frags = 1; }
+
+	size_t n = 1;
+	while (n < this->cfg.queues) { n <<= 1; }
+	mask = n - 1;
+
+	queues.reset(new queue[this->cfg.queues]);
+	table.reset(new queue *[n]());
+	for (unsigned int i = 0; i < this->cfg.queues; i++) {
+		queues[i].owner = this;
+		idle.push_back(queues[i]);
+	}
+}
+
+ip4_reasm::~ip4_reasm()
+{
+	for (auto &q : lru) {
+		wheel.cancel(static_cast<queue &>(q));
+	}
+}
+
+size_t ip4_reasm::slot(uint32_t saddr, uint32_t daddr, uint16_t id, uint8_t proto) const
+{
+	// The seed keeps senders from picking ids that all land in one chain.
+	uint64_t h = (uint64_t(saddr) << 32 | daddr) ^ seed;
+	h *= 0x9e3779b97f4a7c15ull;
+	h ^= (uint64_t(id) << 8 | proto) ^ (h >> 29);
+	h *= 0xbf58476d1ce4e5b9ull;
+	return (h ^ (h >> 32)) & mask;
+}
+
+ip4_reasm::queue *ip4_reasm::find(const ip4_hdr &hdr, unsigned int hoff)
+{
+	queue **head = &table[slot(hdr.saddr, hdr.daddr, hdr.id, hdr.proto)];
+	for (queue *q = *head; q != nullptr; q = q->next) {
+		if (q->saddr == hdr.saddr && q->daddr == hdr.daddr &&
+				q->id == hdr.id && q->proto == hdr.proto) {
+			return q;
+		}
+	}
+
+	if (idle.is_empty()) {
+		drop_oldest();
+		// The evicted queue may have been the head of this chain.
+		head = &table[slot(hdr.saddr, hdr.daddr, hdr.id, hdr.proto)];
+	}
+
+	queue &q = static_cast<queue &>(idle.front());
+	lru.push_back(q);
+	q.next = *head;
+	*head = &q;
+	q.saddr = hdr.saddr;
+	q.daddr = hdr.daddr;
+	q.id = hdr.id;
+	q.proto = hdr.proto;
+	q.has_last = false;
+	q.hoff = hoff;
+	q.total = 0;
+	q.nholes = 1;
+	q.holes[0] = range(0, UNET_IP4_REASM_END);
+	q.count = 0;
+	q.mem = 0;
+	wheel.arm(q, cfg.timeout_ms);
+	return &q;
+}
+
+void ip4_reasm::drop(queue &q)
+{
+	wheel.cancel(q);
+
+	queue **at = &table[slot(q.saddr, q.daddr, q.id, q.proto)];
+	while (*at != &q) { at = &(*at)->next; }
+	*at = q.next;
+	q.next = nullptr;
+
+	q.frags.clear();
+	st.mem -= q.mem;
+	idle.push_back(q);
+}
+
+void ip4_reasm::drop_oldest()
+{
+	st.evicted++;
+	drop(static_cast<queue &>(lru.front()));
+}
+
+void ip4_reasm::queue::expired(timer &t)
+{
+	queue &q = static_cast<queue &>(t);
+	q.owner->st.timeouts++;
+	q.owner->drop(q);
+}
+
+ip4_reasm::fill_result ip4_reasm::fill(queue &q, unsigned int off, unsigned int len, bool last)
+{
+	unsigned int end = off + len;
+	if (q.has_last && (end > q.total || (last && end != q.total))) {
+		return FILL_OVERLAP;
+	}
+
+	for (unsigned int i = 0; i < q.nholes; i++) {
+		const range &h = q.holes[i];
+		if (end <= h.offset() || off >= h.end()) { continue; }
+
+		// Anything short of landing wholly inside one hole rewrites data
+		// we already have.
+		if (off < h.offset() || end > h.end()) { return FILL_OVERLAP; }
+		if (last && h.end() != UNET_IP4_REASM_END) { return FILL_OVERLAP; }
+
+		range left(h.offset(), off - h.offset());
+		range right(end, last ? 0 : h.end() - end);
+		if (!left.is_empty() && !right.is_empty()) {
+			if (q.nholes == UNET_IP4_REASM_HOLES) { return FILL_TOO_MANY; }
+			q.holes[i] = left;
+			q.holes[q.nholes++] = right;
+		}
+		else if (!left.is_empty()) { q.holes[i] = left; }
+		else if (!right.is_empty()) { q.holes[i] = right; }
+		else { q.holes[i] = q.holes[--q.nholes]; }
+
+		if (last) {
+			q.has_last = true;
+			q.total = end;
+		}
+		return FILL_OK;
+	}
+	return FILL_DUP;
+}
+
+buffer::unique_ptr ip4_reasm::complete(queue &q)
+{
+	const ip4_hdr *first = nullptr;
+	buffer_pool *pool = nullptr;
+	for (auto &f : q.frags) {
+		auto &hdr = *reinterpret_cast<const ip4_hdr *>(f.data() + q.hoff);
+		if ((hdr.frag_off & hton16(UNET_IP4_OFFMASK)) == 0) { first = &hdr; }
+		if (pool == nullptr) { pool = f.owner(); }
+	}
+
+	unsigned int hlen = first->hlen();
+	if (hlen + q.total > 0xffff) {
+		st.invalid++;
+		drop(q);
+		return nullptr;
+	}
+
+	// The datagram keeps the first fragment's link header in front of it,
+	// so it can be handled like any other frame.
+	unsigned int n = q.hoff + hlen + q.total;
+	buffer::unique_ptr out;
+	if (pool && n <= pool->buffer_size()) { out = pool->make(); }
+	if (!out) { out.reset(buffer::create(n)); }
+
+	uint8_t *p = out->data();
+	memcpy(p, reinterpret_cast<const uint8_t *>(first) - q.hoff, q.hoff + hlen);
+	for (auto &f : q.frags) {
+		auto &hdr = *reinterpret_cast<const ip4_hdr *>(f.data() + q.hoff);
+		unsigned int off = (ntoh16(hdr.frag_off) & UNET_IP4_OFFMASK) * 8;
+		memcpy(p + q.hoff + hlen + off, hdr.data + (hdr.hlen() - UNET_IP4_HLEN), hdr.length() - hdr.hlen());
+	}
+	out->bump(n);
+
+	ip4_hdr &hdr = *reinterpret_cast<ip4_hdr *>(p + q.hoff);
+	hdr.len = hton16(hlen + q.total);
+	hdr.frag_off &= hton16(UNET_IP4_DF);
+	hdr.set_check();
+
+	st.reassembled++;
+	drop(q);
+	return out;
+}
+
+buffer::unique_ptr ip4_reasm::add(buffer &buf, const ip4_hdr &hdr, unsigned int hoff)
+{
+	st.fragments++;
+
+	unsigned int hlen = hdr.hlen();
+	unsigned int len = hdr.length() - hlen;
+	unsigned int off = (ntoh16(hdr.frag_off) & UNET_IP4_OFFMASK) * 8;
+	bool last = !(hdr.frag_off & hton16(UNET_IP4_MF));
+	if (len == 0 || (!last && len % 8) || off + len + hlen > 0xffff) {
+		st.invalid++;
+		return nullptr;
+	}
+
+	queue &q = *find(hdr, hoff);
+	if (q.hoff != hoff || q.count == cfg.frags) {
+		st.invalid++;
+		drop(q);
+		return nullptr;
+	}
+
+	// Frames in device memory have to be copied before they can be held,
+	// and frames not in a list belong to someone further up.
+	buffer::unique_ptr copy;
+	if (buf.is_external() || !buf.is_added()) {
+		unsigned int n = hoff + hdr.length();
+		buffer_pool *pool = buf.owner();
+		if (pool && n <= pool->buffer_size()) { copy = pool->make(); }
+		else if (!pool) { copy.reset(buffer::create(n)); }
+		if (!copy) {
+			st.no_buffer++;
+			if (q.count == 0) { drop(q); }
+			return nullptr;
+		}
+		memcpy(copy->data(), buf.data(), n);
+		copy->bump(n);
+	}
+
+	switch (fill(q, off, len, last)) {
+	case FILL_OK:
+		break;
+	case FILL_DUP:
+		st.duplicates++;
+		return nullptr;
+	case FILL_OVERLAP:
+		st.overlaps++;
+		drop(q);
+		return nullptr;
+	case FILL_TOO_MANY:
+		st.invalid++;
+		drop(q);
+		return nullptr;
+	}
+
+	buffer &held = copy ? *copy.release() : *buf.take().release();
+	q.frags.push_back(held);
+	q.count++;
+	q.mem += sizeof(buffer) + held.size();
+	st.mem += sizeof(buffer) + held.size();
+
+	if (q.nholes == 0) { return complete(q); }
+
+	while (st.mem > cfg.mem && !lru.is_empty()) {
+		drop_oldest();
+	}
+	return nullptr;
+}
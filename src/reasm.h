@@ -0,0 +1,128 @@
+#ifndef UNET_REASM_H
+#define UNET_REASM_H
+
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include "base.h"
+#include "buffer.h"
+#include "range.h"
+#include "timer.h"
+
+#define UNET_IP4_REASM_HOLES 16   /* Max. gaps tracked per datagram */
+
+namespace unet
+{
+	struct ip4_hdr;
+
+	struct ip4_reasm_config
+	{
+		size_t mem = 4 << 20;           /* octets of fragments held at once */
+		unsigned int queues = 1024;     /* datagrams in reassembly at once */
+		unsigned int frags = 64;        /* fragments per datagram */
+		uint64_t timeout_ms = 30000;    /* from first fragment to giving up */
+	};
+
+	/**
+	 * IPv4 fragment reassembly. Fragments are kept in the frames they
+	 * arrived in, chained on their datagram's queue, and only copied out
+	 * once the datagram is complete. The missing parts of each datagram are
+	 * tracked as a short list of holes (RFC 815).
+	 *
+	 * Queues come from a fixed set allocated up front and are looked up by
+	 * (source, destination, id, protocol) in a seeded hash table. A queue
+	 * that is not complete within the timeout is dropped, and the oldest
+	 * queues are dropped whenever the fragments held add up to more than
+	 * the memory budget or a new datagram needs a queue. A fragment that
+	 * overlaps data already received drops its whole datagram (RFC 5722
+	 * does the same for IPv6), so overlapping rewrites can't be used to
+	 * smuggle headers past a filter.
+	 */
+	class ip4_reasm : private nocopy, private nomove
+	{
+	public:
+		struct stats
+		{
+			size_t fragments;    /* fragments seen */
+			size_t reassembled;  /* datagrams completed */
+			size_t timeouts;     /* datagrams dropped on timeout */
+			size_t evicted;      /* datagrams dropped for room */
+			size_t overlaps;     /* datagrams dropped for overlaps */
+			size_t duplicates;   /* fragments already received */
+			size_t invalid;      /* fragments or datagrams malformed or over limits */
+			size_t no_buffer;    /* fragments dropped for want of a buffer to copy to */
+			size_t mem;          /* octets of fragments currently held */
+		};
+
+		explicit ip4_reasm(timer_wheel &wheel, const ip4_reasm_config &cfg = ip4_reasm_config());
+		~ip4_reasm();
+
+		/**
+		 * Adds the fragment whose header is at hoff in buf. The frame is
+		 * taken out of its list if held, or copied if it is attached to
+		 * device memory. Returns the datagram once its last missing fragment
+		 * arrives, laid out like the fragments with its header at hoff.
+		 */
+		buffer::unique_ptr add(buffer &buf, const ip4_hdr &hdr, unsigned int hoff);
+
+		const stats &get_stats() const { return st; }
+
+	private:
+		struct queue_link;
+
+		struct queue_keep
+		{
+			void operator()(queue_link *) const noexcept {}
+		};
+
+		using queue_list = ilist<queue_link, queue_keep>;
+
+		// A separate base so the list's entry and the timer's don't meet
+		// in name lookup on queue.
+		struct queue_link : public queue_list::entry {};
+
+		struct queue : public queue_link, public timer
+		{
+			ip4_reasm *owner = nullptr;
+			queue *next = nullptr;      /* hash chain */
+			uint32_t saddr = 0;
+			uint32_t daddr = 0;
+			uint16_t id = 0;
+			uint8_t  proto = 0;
+			bool     has_last = false;
+			unsigned int hoff = 0;
+			unsigned int total = 0;     /* payload octets, once has_last */
+			unsigned int nholes = 0;
+			range holes[UNET_IP4_REASM_HOLES];
+			buffer_list frags;
+			unsigned int count = 0;
+			size_t mem = 0;
+
+			queue() : timer(expired) {}
+			static void expired(timer &t);
+		};
+
+		enum fill_result { FILL_OK, FILL_DUP, FILL_OVERLAP, FILL_TOO_MANY };
+
+		timer_wheel &wheel;
+		ip4_reasm_config cfg;
+		std::unique_ptr<queue[]> queues;
+		std::unique_ptr<queue *[]> table;
+		size_t mask;
+		uint64_t seed;
+		queue_list lru;    /* in use, oldest first */
+		queue_list idle;
+		stats st = {};
+
+		size_t slot(uint32_t saddr, uint32_t daddr, uint16_t id, uint8_t proto) const;
+		queue *find(const ip4_hdr &hdr, unsigned int hoff);
+		void drop(queue &q);
+		void drop_oldest();
+		fill_result fill(queue &q, unsigned int off, unsigned int len, bool last);
+		buffer::unique_ptr complete(queue &q);
+	};
+}
+
+#endif
+
@@ -0,0 +1,196 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace unet;
+
+void counter_set::add(const std::string &name, size_t val)
+{
+	const std::string key = prefix + name;
+	for (auto &v : vals) {
+		if (v.first == key) {
+			v.second += val;
+			return;
+		}
+	}
+	vals.emplace_back(key, val);
+}
+
+std::string counter_set::format() const
+{
+	std::string s;
+	char buf[32];
+	for (auto &v : vals) {
+		int n = snprintf(buf, sizeof(buf), " %zu\n", v.second);
+		s.append(v.first);
+		s.append(buf, n);
+	}
+	return s;
+}
+
+unsigned int stats_registry::add(collect_fn fn, void *ctx)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	unsigned int id = next++;
+	sources.push_back(source{id, fn, ctx});
+	return id;
+}
+
+void stats_registry::remove(unsigned int id)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto it = sources.begin(); it != sources.end(); ++it) {
+		if (it->id == id) {
+			sources.erase(it);
+			return;
+		}
+	}
+}
+
+counter_set stats_registry::snapshot() const
+{
+	counter_set set;
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto &src : sources) {
+		src.fn(src.ctx, set);
+	}
+	return set;
+}
+
+// Sockets are written with send so a client that went away raises no SIGPIPE.
+static void write_all(int fd, const std::string &s, bool sock)
+{
+	size_t n = 0;
+	while (n < s.size()) {
+		ssize_t rc = sock ?
+			::send(fd, s.data() + n, s.size() - n, MSG_NOSIGNAL) :
+			::write(fd, s.data() + n, s.size() - n);
+		if (rc < 0) {
+			if (errno == EINTR) { continue; }
+			return;
+		}
+		n += rc;
+	}
+}
+
+std::error_code stats_server::start(const char *p)
+{
+	if (th.joinable()) {
+		return std::error_code();
+	}
+
+	std::error_code ec;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+
+	if ((errno = pthread_sigmask(SIG_BLOCK, &mask, nullptr)) != 0 ||
+			(sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0 ||
+			(efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		ec = std::error_code(errno, std::system_category());
+		close_fds();
+		return ec;
+	}
+
+	if (p) {
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		if (strlen(p) >= sizeof(sa.sun_path)) {
+			close_fds();
+			return std::make_error_code(std::errc::filename_too_long);
+		}
+		strcpy(sa.sun_path, p);
+
+		// A socket left behind by an earlier run would fail the bind.
+		unlink(p);
+		if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+				bind(lfd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) < 0 ||
+				listen(lfd, 16) < 0) {
+			ec = std::error_code(errno, std::system_category());
+			close_fds();
+			return ec;
+		}
+		path = p;
+	}
+
+	th = std::thread(&stats_server::run, this);
+	return ec;
+}
+
+void stats_server::stop()
+{
+	if (th.joinable()) {
+		uint64_t one = 1;
+		while (::write(efd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+		th.join();
+	}
+	close_fds();
+}
+
+void stats_server::close_fds()
+{
+	for (int *fd : { &lfd, &sfd, &efd }) {
+		if (*fd >= 0) {
+			while (::close(*fd) < 0 && errno == EINTR) {}
+			*fd = -1;
+		}
+	}
+	if (!path.empty()) {
+		unlink(path.c_str());
+		path.clear();
+	}
+}
+
+std::string stats_server::format() const
+{
+	std::string s = reg.snapshot().format();
+	if (report) {
+		s.append(report(report_ctx));
+	}
+	return s;
+}
+
+void stats_server::run()
+{
+	struct pollfd pfd[3] = {
+		{ efd, POLLIN, 0 },
+		{ sfd, POLLIN, 0 },
+		{ lfd, POLLIN, 0 },
+	};
+	nfds_t n = lfd >= 0 ? 3 : 2;
+
+	for (;;) {
+		if (::poll(pfd, n, -1) < 0) {
+			if (errno == EINTR) { continue; }
+			return;
+		}
+		if (pfd[0].revents) {
+			return;
+		}
+		if (pfd[1].revents) {
+			struct signalfd_siginfo si;
+			if (::read(sfd, &si, sizeof(si)) == sizeof(si)) {
+				write_all(out, format(), false);
+			}
+		}
+		if (n > 2 && pfd[2].revents) {
+			// A snapshot is a few kilobytes and fits in the socket buffer,
+			// so the write can't stall on a slow client.
+			int c = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (c >= 0) {
+				write_all(c, format(), true);
+				while (::close(c) < 0 && errno == EINTR) {}
+			}
+		}
+	}
+}
@@ -0,0 +1,146 @@
+#ifndef UNET_STATS_H
+#define UNET_STATS_H
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <system_error>
+#include <cstdint>
+#include <unistd.h>
+
+#include "base.h"
+
+#define UNET_CACHELINE      64   /* Octets in a cache line */
+
+namespace unet
+{
+	/**
+	 * Counters owned by one thread, with a cache line of padding on
+	 * either side so they never share a line with anything another thread
+	 * writes, wherever their owner happens to be allocated.
+	 */
+	template <typename T>
+	struct padded
+	{
+		uint8_t _head[UNET_CACHELINE];
+		T val = {};
+		uint8_t _tail[UNET_CACHELINE - sizeof(T) % UNET_CACHELINE];
+
+		T *operator->() { return &val; }
+		const T *operator->() const { return &val; }
+		T &operator*() { return val; }
+		const T &operator*() const { return val; }
+	};
+
+	/**
+	 * Named counter values. Adding a name that is already there sums the
+	 * values, so the stacks of every thread collect into one set.
+	 */
+	class counter_set
+	{
+		std::vector<std::pair<std::string, size_t>> vals;
+		std::string prefix;
+
+	public:
+		void add(const std::string &name, size_t val);
+
+		// Puts p in front of every name added until it is changed.
+		void set_prefix(const std::string &p) { prefix = p; }
+
+		/**
+		 * Formats the set as one "name value" line per counter, in the
+		 * order the names were first added.
+		 */
+		std::string format() const;
+
+		const std::vector<std::pair<std::string, size_t>> &values() const { return vals; }
+	};
+
+	/**
+	 * Sources of counters, each a function that adds what it counts to a
+	 * set. Counters are written by their owning thread without atomics
+	 * or locks and read whenever a snapshot is taken, so a snapshot is
+	 * exact per counter but not across counters. The lock only guards the
+	 * list of sources, so one can't go away in the middle of a snapshot.
+	 */
+	class stats_registry : private nocopy, private nomove
+	{
+	public:
+		using collect_fn = void (*)(void *ctx, counter_set &out);
+
+		unsigned int add(collect_fn fn, void *ctx);
+
+		// Adds anything with a collect(counter_set &) const method.
+		template <typename T>
+		unsigned int add(const T &src)
+		{
+			return add([](void *ctx, counter_set &out) {
+				static_cast<const T *>(ctx)->collect(out);
+			}, const_cast<T *>(&src));
+		}
+
+		void remove(unsigned int id);
+
+		counter_set snapshot() const;
+
+	private:
+		struct source
+		{
+			unsigned int id;
+			collect_fn fn;
+			void *ctx;
+		};
+
+		mutable std::mutex lock;
+		std::vector<source> sources;
+		unsigned int next = 1;
+	};
+
+	/**
+	 * Serves snapshots of a registry from a background thread: one to each
+	 * client that connects to a Unix socket, which is then closed, and one
+	 * to out on every SIGUSR1. A report function can add free text after
+	 * the counters, as lines starting with "#". The signal is taken
+	 * through a signalfd, so start blocks it in the calling thread and must
+	 * run before any other thread is created, for them to inherit the mask.
+	 */
+	class stats_server : private nocopy, private nomove
+	{
+	public:
+		using report_fn = std::string (*)(void *ctx);
+
+	private:
+		stats_registry &reg;
+		int out;
+		report_fn report = nullptr;
+		void *report_ctx = nullptr;
+		std::string path;
+		int lfd = -1;
+		int sfd = -1;
+		int efd = -1;
+		std::thread th;
+
+		void run();
+		void close_fds();
+		std::string format() const;
+
+	public:
+		explicit stats_server(stats_registry &reg, int out = STDOUT_FILENO) : reg(reg), out(out) {}
+		~stats_server() { stop(); }
+
+		// Listens on the socket at path as well, if it is not null.
+		std::error_code start(const char *path = nullptr);
+		void stop();
+
+		// Set before start.
+		void set_report(report_fn fn, void *ctx)
+		{
+			report = fn;
+			report_ctx = ctx;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,17 @@
+#include "thread.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+std::error_code unet::pin_thread(unsigned int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		return std::error_code(rc, std::system_category());
+	}
+	return std::error_code();
+}
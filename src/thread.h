@@ -0,0 +1,12 @@
+#ifndef UNET_THREAD_H
+#define UNET_THREAD_H
+
+#include <system_error>
+
+namespace unet
+{
+	std::error_code pin_thread(unsigned int cpu);
+}
+
+#endif
+
@@ -0,0 +1,118 @@
+#include "timer.h"
+
+#include <time.h>
+
+#define MASK       (UNET_TIMER_SLOTS - 1)
+#define SPAN(l)    (1ull << (UNET_TIMER_BITS * (l)))
+#define MAX_DELAY  (SPAN(UNET_TIMER_LEVELS) - 1)
+
+using namespace unet;
+
+static inline uint64_t rotr(uint64_t v, unsigned int n)
+{
+	return (v >> n) | (v << ((64 - n) & 63));
+}
+
+uint64_t unet::coarse_clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel::place(timer &t)
+{
+	// Delays past the top level park in its furthest slot and are placed
+	// again when it cascades.
+	uint64_t delta = t.when - current;
+	uint64_t when = delta > MAX_DELAY ? current + MAX_DELAY : t.when;
+	unsigned int level = 0;
+
+	if (delta > 0) {
+		level = (63 - __builtin_clzll(delta)) / UNET_TIMER_BITS;
+		if (level >= UNET_TIMER_LEVELS) { level = UNET_TIMER_LEVELS - 1; }
+	}
+
+	unsigned int idx = (when >> (UNET_TIMER_BITS * level)) & MASK;
+	slots[level][idx].push_back(t);
+	pending[level] |= 1ull << idx;
+	t.slot = level * UNET_TIMER_SLOTS + idx;
+}
+
+void timer_wheel::cascade(unsigned int level, unsigned int idx)
+{
+	timer_list moving;
+	moving.splice_back(slots[level][idx]);
+	pending[level] &= ~(1ull << idx);
+
+	while (!moving.is_empty()) {
+		place(*moving.take_front().release());
+	}
+}
+
+void timer_wheel::run(unsigned int idx)
+{
+	timer_list due;
+	due.splice_back(slots[0][idx]);
+	pending[0] &= ~(1ull << idx);
+
+	while (!due.is_empty()) {
+		timer &t = *due.take_front().release();
+		t.fn(t);
+	}
+}
+
+uint64_t timer_wheel::next_tick() const
+{
+	uint64_t next = UINT64_MAX;
+	for (unsigned int l = 0; l < UNET_TIMER_LEVELS; l++) {
+		if (pending[l] == 0) { continue; }
+
+		// The next slot index to come up at this level, and from there the
+		// first non-empty one, wrapping around into the next rotation.
+		unsigned int shift = UNET_TIMER_BITS * l;
+		uint64_t base = (current >> shift) + 1;
+		uint64_t bits = rotr(pending[l], base & MASK);
+		uint64_t tick = (base + __builtin_ctzll(bits)) << shift;
+		if (tick < next) { next = tick; }
+	}
+	return next;
+}
+
+void timer_wheel::arm_at(timer &t, uint64_t when)
+{
+	cancel(t);
+	t.when = when > current ? when : current + 1;
+	place(t);
+}
+
+void timer_wheel::cancel(timer &t)
+{
+	if (!t.is_armed()) { return; }
+
+	unsigned int level = t.slot / UNET_TIMER_SLOTS;
+	unsigned int idx = t.slot % UNET_TIMER_SLOTS;
+	t.take();
+	if (slots[level][idx].is_empty()) {
+		pending[level] &= ~(1ull << idx);
+	}
+}
+
+void timer_wheel::advance(uint64_t now)
+{
+	while (current < now) {
+		uint64_t tick = next_tick();
+		if (tick > now) {
+			current = now;
+			break;
+		}
+
+		current = tick;
+		for (unsigned int l = 1; l < UNET_TIMER_LEVELS; l++) {
+			if (tick & (SPAN(l) - 1)) { break; }
+			cascade(l, (tick >> (UNET_TIMER_BITS * l)) & MASK);
+		}
+		run(tick & MASK);
+	}
+}
+
@@ -0,0 +1,91 @@
+#ifndef UNET_TIMER_H
+#define UNET_TIMER_H
+
+#include <cstdint>
+
+#include "base.h"
+#include "ilist.h"
+
+#define UNET_TIMER_BITS     6    /* log2 of the slots per wheel level */
+#define UNET_TIMER_SLOTS    (1u << UNET_TIMER_BITS)
+#define UNET_TIMER_LEVELS   6    /* 2^36 ticks, over two years in ms */
+
+namespace unet
+{
+	class timer;
+
+	struct timer_keep
+	{
+		void operator()(timer *) const noexcept {}
+	};
+
+	using timer_list = ilist<timer, timer_keep>;
+
+	/**
+	 * Milliseconds from a coarse monotonic clock, cheap enough to read once
+	 * per burst.
+	 */
+	uint64_t coarse_clock_ms();
+
+	/**
+	 * A timer is embedded in the object it times out, which gets it back
+	 * in the callback by casting down from the timer. Timers must be
+	 * cancelled before they are destroyed.
+	 */
+	class timer : public timer_list::entry, private nocopy, private nomove
+	{
+		friend class timer_wheel;
+
+	public:
+		using callback = void (*)(timer &t);
+
+		explicit timer(callback fn) : fn(fn) {}
+
+		bool is_armed() const { return is_added(); }
+		uint64_t deadline() const { return when; }
+
+	private:
+		callback fn;
+		uint64_t when = 0;
+		uint16_t slot = 0;
+	};
+
+	/**
+	 * Hierarchical timing wheel. Level n has UNET_TIMER_SLOTS slots of
+	 * UNET_TIMER_SLOTS^n ticks each; a timer sits on the lowest level its
+	 * delay fits in and moves down as its slot comes due. Arming and
+	 * cancelling are O(1) and never allocate, and a bitmap of non-empty
+	 * slots per level lets advance skip idle ticks instead of visiting them.
+	 *
+	 * Not thread safe: the owner serializes arm, cancel and advance.
+	 */
+	class timer_wheel : private nocopy, private nomove
+	{
+		timer_list slots[UNET_TIMER_LEVELS][UNET_TIMER_SLOTS];
+		uint64_t pending[UNET_TIMER_LEVELS] = {};
+		uint64_t current;
+
+		void place(timer &t);
+		void cascade(unsigned int level, unsigned int idx);
+		void run(unsigned int idx);
+		uint64_t next_tick() const;
+
+	public:
+		explicit timer_wheel(uint64_t now) : current(now) {}
+
+		uint64_t now() const { return current; }
+
+		void arm(timer &t, uint64_t delay) { arm_at(t, current + delay); }
+		void arm_at(timer &t, uint64_t when);
+		void cancel(timer &t);
+
+		/**
+		 * Moves the wheel forward to now, running every timer that comes
+		 * due on the way. Callbacks may arm and cancel timers.
+		 */
+		void advance(uint64_t now);
+	};
+}
+
+#endif
+
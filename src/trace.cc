@@ -0,0 +1,237 @@
+#include "trace.h"
+#include "eth.h"
+#include "device.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+using namespace unet;
+
+thread_local tracer *tracer::current = nullptr;
+
+const char *unet::trace_stage_name(trace_stage stage)
+{
+	switch (stage) {
+#define X(name, str) case TRACE_##name: return str;
+		UNET_TRACE_STAGE
+#undef X
+	case TRACE_STAGES: break;
+	}
+	return "(unknown)";
+}
+
+void hdr_histogram::merge(const hdr_histogram &other)
+{
+	for (unsigned int i = 0; i < buckets; i++) {
+		counts[i] += other.counts[i];
+	}
+	n += other.n;
+	lo = std::min(lo, other.lo);
+	hi = std::max(hi, other.hi);
+}
+
+uint64_t hdr_histogram::percentile(double p) const
+{
+	if (n == 0) { return 0; }
+
+	uint64_t want = (uint64_t)(p / 100 * n + 0.5);
+	if (want == 0) { want = 1; }
+
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < buckets; i++) {
+		seen += counts[i];
+		if (seen >= want) {
+			return std::min(std::max(lower(i), lo), hi);
+		}
+	}
+	return hi;
+}
+
+tracer::tracer(const trace_config &c) : cfg(c)
+{
+	if (cfg.sample == 0) { cfg.sample = 1; }
+	cfg.slowest = std::min(cfg.slowest, (unsigned int)UNET_TRACE_SLOWEST);
+	countdown = cfg.sample;
+	slow.reset(new trace[cfg.slowest]);
+}
+
+void tracer::recv_burst(eth &recvr, buffer_list &frames, uint64_t read)
+{
+	for (auto &buf : frames) {
+		if (frames.has_next(buf)) {
+			__builtin_prefetch(frames.next(buf).data());
+		}
+		if (--countdown != 0) {
+			recvr.recv(buf);
+			continue;
+		}
+		countdown = cfg.sample;
+		burst_traced = true;
+		begin(buf, read);
+		recvr.recv(buf);
+		end();
+	}
+}
+
+void tracer::flush_burst(device &dev)
+{
+	if (!burst_traced) {
+		dev.flush();
+		return;
+	}
+	burst_traced = false;
+	uint64_t t = trace_clock();
+	dev.flush();
+	hist[TRACE_SUBMIT].record(trace_clock() - t);
+}
+
+void tracer::begin(buffer &buf, uint64_t read)
+{
+	// The frame is kept as it arrived, before a handler can rewrite it.
+	memset(cur.stage, 0, sizeof(cur.stage));
+	cur.len = buf.length();
+	cur.caplen = std::min(cur.len, (unsigned int)UNET_TRACE_SNAPLEN);
+	memcpy(cur.frame, buf.data(), cur.caplen);
+
+	start = trace_clock();
+	cur.stage[TRACE_RX] = start - read;
+	current = this;
+}
+
+void tracer::end()
+{
+	current = nullptr;
+	cur.stage[TRACE_TOTAL] = cur.stage[TRACE_RX] + trace_clock() - start;
+	sampled++;
+
+	for (unsigned int s = 0; s < TRACE_STAGES; s++) {
+		if (cur.stage[s] || s == TRACE_RX || s == TRACE_TOTAL) {
+			hist[s].record(cur.stage[s]);
+		}
+	}
+
+	if (cfg.slowest == 0) {
+		return;
+	}
+	std::unique_lock<std::mutex> guard(slow_lock, std::try_to_lock);
+	if (!guard.owns_lock()) {
+		return;
+	}
+	if (nslow < cfg.slowest) {
+		slow[nslow++] = cur;
+		return;
+	}
+
+	unsigned int min = 0;
+	for (unsigned int i = 1; i < nslow; i++) {
+		if (slow[i].stage[TRACE_TOTAL] < slow[min].stage[TRACE_TOTAL]) { min = i; }
+	}
+	if (cur.stage[TRACE_TOTAL] > slow[min].stage[TRACE_TOTAL]) {
+		slow[min] = cur;
+	}
+}
+
+static double measure_clock_rate()
+{
+#ifdef UNET_TRACE_TSC
+	using clock = std::chrono::steady_clock;
+	auto t0 = clock::now();
+	uint64_t c0 = trace_clock();
+	while (clock::now() - t0 < std::chrono::milliseconds(20)) {}
+	std::chrono::duration<double, std::nano> elapsed = clock::now() - t0;
+	return (trace_clock() - c0) / elapsed.count();
+#else
+	return 1.0;
+#endif
+}
+
+double unet::trace_clock_rate()
+{
+	static const double rate = measure_clock_rate();
+	return rate;
+}
+
+trace_set::trace_set(const trace_config &cfg) : cfg(cfg), ticks_per_ns(trace_clock_rate())
+{
+}
+
+tracer &trace_set::attach()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	tracers.emplace_back(new tracer(cfg));
+	return *tracers.back();
+}
+
+void trace_set::collect(counter_set &out) const
+{
+	std::unique_ptr<hdr_histogram[]> merged(new hdr_histogram[TRACE_STAGES]);
+	size_t sampled = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto &t : tracers) {
+			sampled += t->sampled;
+			for (unsigned int s = 0; s < TRACE_STAGES; s++) {
+				merged[s].merge(t->hist[s]);
+			}
+		}
+	}
+
+	out.add("trace.sampled", sampled);
+	for (unsigned int s = 0; s < TRACE_STAGES; s++) {
+		const hdr_histogram &h = merged[s];
+		std::string name = std::string("trace.") + trace_stage_name(static_cast<trace_stage>(s));
+		out.add(name + ".count", h.count());
+		out.add(name + ".p50_ns", ns(h.percentile(50)));
+		out.add(name + ".p90_ns", ns(h.percentile(90)));
+		out.add(name + ".p99_ns", ns(h.percentile(99)));
+		out.add(name + ".p999_ns", ns(h.percentile(99.9)));
+		out.add(name + ".max_ns", ns(h.max()));
+	}
+}
+
+std::string trace_set::slowest() const
+{
+	std::vector<tracer::trace> all;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto &t : tracers) {
+			std::lock_guard<std::mutex> slow_guard(t->slow_lock);
+			all.insert(all.end(), t->slow.get(), t->slow.get() + t->nslow);
+		}
+	}
+
+	std::sort(all.begin(), all.end(), [](const tracer::trace &a, const tracer::trace &b) {
+		return a.stage[TRACE_TOTAL] > b.stage[TRACE_TOTAL];
+	});
+	if (all.size() > cfg.slowest) {
+		all.resize(cfg.slowest);
+	}
+
+	std::string s;
+	char buf[256];
+	for (size_t i = 0; i < all.size(); i++) {
+		const tracer::trace &t = all[i];
+		s.append(buf, snprintf(buf, sizeof(buf), "# slow %zu:", i + 1));
+		for (unsigned int st = 0; st < TRACE_STAGES; st++) {
+			if (t.stage[st] || st == TRACE_TOTAL) {
+				s.append(buf, snprintf(buf, sizeof(buf), " %s %llu ns",
+						trace_stage_name(static_cast<trace_stage>(st)),
+						(unsigned long long)ns(t.stage[st])));
+			}
+		}
+		s.append(buf, snprintf(buf, sizeof(buf), ", %u octets", t.len));
+
+		if (t.caplen >= UNET_ETH_HLEN) {
+			s.append(", ");
+			s.append(buf, eth_format(buf, sizeof(buf), *reinterpret_cast<const eth_hdr *>(t.frame)));
+		}
+
+		s.append(": ");
+		for (unsigned int j = 0; j < t.caplen; j++) {
+			s.append(buf, snprintf(buf, sizeof(buf), "%02x", t.frame[j]));
+		}
+		s.push_back('\n');
+	}
+	return s;
+}
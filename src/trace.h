@@ -0,0 +1,250 @@
+#ifndef UNET_TRACE_H
+#define UNET_TRACE_H
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+#include "base.h"
+#include "buffer.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define UNET_TRACE_TSC 1
+# include <x86intrin.h>
+#endif
+
+#define UNET_HDR_BITS       5    /* Significant bits kept by hdr_histogram */
+#define UNET_TRACE_SNAPLEN  64   /* Octets of each slow frame kept */
+#define UNET_TRACE_SLOWEST  64   /* Max. slow frames kept per thread */
+
+#define UNET_TRACE_STAGE \
+	X(RX,     "rx")     /* device read returned until eth::recv starts */ \
+	X(ETH,    "eth")    /* link header parse and dispatch */ \
+	X(ARP,    "arp")    /* arp::recv */ \
+	X(IP,     "ip")     /* ip::recv, with the protocol handlers it calls */ \
+	X(OTHER,  "other")  /* handlers attached for any other eth type, VLAN stacks included */ \
+	X(TX,     "tx")     /* device writes made while handling the frame, short of submission */ \
+	X(SUBMIT, "submit") /* flush after a burst with a traced frame, per burst */ \
+	X(TOTAL,  "total")  /* device read returned until eth::recv returns */ \
+
+namespace unet
+{
+	class eth;
+	class device;
+
+	enum trace_stage : unsigned int
+	{
+#define X(name, str) TRACE_##name,
+		UNET_TRACE_STAGE
+#undef X
+		TRACE_STAGES
+	};
+
+	const char *trace_stage_name(trace_stage stage);
+
+	/**
+	 * Ticks of the cheapest clock there is: the TSC where there is one,
+	 * the monotonic clock in nanoseconds elsewhere.
+	 */
+	inline uint64_t trace_clock()
+	{
+#ifdef UNET_TRACE_TSC
+		return __rdtsc();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	}
+
+	/**
+	 * Ticks of trace_clock per nanosecond, measured against the steady
+	 * clock on the first call, which takes 20 ms.
+	 */
+	double trace_clock_rate();
+
+	/**
+	 * Log-linear histogram in the manner of HdrHistogram. Values are
+	 * bucketed by their top UNET_HDR_BITS significant bits, so a bucket's
+	 * lower bound is within 1/2^UNET_HDR_BITS of anything recorded in it,
+	 * across the whole 64-bit range, and recording never allocates.
+	 */
+	class hdr_histogram
+	{
+		static const unsigned int sub = 1u << UNET_HDR_BITS;
+		static const unsigned int buckets = (65 - UNET_HDR_BITS) * sub;
+
+		uint64_t counts[buckets] = {};
+		uint64_t n = 0;
+		uint64_t lo = UINT64_MAX;
+		uint64_t hi = 0;
+
+		static unsigned int index(uint64_t v)
+		{
+			if (v < sub) { return (unsigned int)v; }
+			unsigned int e = 63 - __builtin_clzll(v);
+			return sub + (e - UNET_HDR_BITS) * sub + (unsigned int)(v >> (e - UNET_HDR_BITS)) - sub;
+		}
+
+		static uint64_t lower(unsigned int i)
+		{
+			if (i < sub) { return i; }
+			unsigned int e = (i - sub) / sub + UNET_HDR_BITS;
+			return (uint64_t)(sub + (i - sub) % sub) << (e - UNET_HDR_BITS);
+		}
+
+	public:
+		void record(uint64_t v)
+		{
+			counts[index(v)]++;
+			n++;
+			lo = std::min(lo, v);
+			hi = std::max(hi, v);
+		}
+
+		void merge(const hdr_histogram &other);
+		void clear() { *this = hdr_histogram(); }
+
+		// The smallest recorded value at or above p percent of all values.
+		uint64_t percentile(double p) const;
+
+		uint64_t count() const { return n; }
+		uint64_t min() const { return n ? lo : 0; }
+		uint64_t max() const { return hi; }
+	};
+
+	struct trace_config
+	{
+		unsigned int sample = 1000;                /* trace one frame in this many */
+		unsigned int slowest = 16;                 /* slowest traced frames kept per thread */
+	};
+
+	/**
+	 * Times the frames of one RX thread through the stack. One frame in
+	 * every cfg.sample is traced: while it is being handled, current
+	 * points at its tracer, and the layers add the time they spend on it
+	 * to its stages. Frames that aren't traced cost the layers a single
+	 * thread-local load each. Finished traces go into a histogram per
+	 * stage, and the slowest are kept with the start of the frame. A trace
+	 * that finishes while a report is copying the slowest isn't kept, so
+	 * the RX thread never waits and reports never see a torn one.
+	 */
+	class tracer : private nocopy, private nomove
+	{
+	public:
+		struct trace
+		{
+			uint64_t stage[TRACE_STAGES];  /* ticks, 0 where the frame didn't go */
+			unsigned int len;              /* octets of the frame */
+			unsigned int caplen;           /* octets kept in frame */
+			uint8_t frame[UNET_TRACE_SNAPLEN];
+		};
+
+		static thread_local tracer *current;
+
+	private:
+		friend class trace_set;
+
+		trace_config cfg;
+		unsigned int countdown;
+		uint64_t start = 0;
+		trace cur;
+		bool burst_traced = false;
+
+		size_t sampled = 0;
+		hdr_histogram hist[TRACE_STAGES];
+		std::unique_ptr<trace[]> slow;
+		unsigned int nslow = 0;
+		mutable std::mutex slow_lock;   /* guards slow and nslow against reports */
+
+		void begin(buffer &buf, uint64_t read);
+		void end();
+
+	public:
+		explicit tracer(const trace_config &cfg);
+
+		/**
+		 * Hands each frame to recvr, tracing those that are sampled. read
+		 * is when the device read that returned them finished.
+		 */
+		void recv_burst(eth &recvr, buffer_list &frames, uint64_t read);
+
+		/**
+		 * Flushes dev after a burst. The writes of a traced frame only
+		 * reach the kernel here, after its trace has ended, so the flush
+		 * is timed on its own as the submit stage of the burst.
+		 */
+		void flush_burst(device &dev);
+
+		void add(trace_stage s, uint64_t ticks) { cur.stage[s] += ticks; }
+		uint64_t started() const { return start; }
+	};
+
+	// Stage timing for the frame being traced, if there is one. Each
+	// returns the clock it read, or 0 if it didn't.
+
+	inline uint64_t trace_start()
+	{
+		return __builtin_expect(tracer::current != nullptr, 0) ? trace_clock() : 0;
+	}
+
+	// Adds the time since the frame's trace began, when eth::recv started.
+	inline uint64_t trace_mark(trace_stage s)
+	{
+		tracer *t = tracer::current;
+		if (__builtin_expect(t == nullptr, 1)) { return 0; }
+		uint64_t now = trace_clock();
+		t->add(s, now - t->started());
+		return now;
+	}
+
+	inline uint64_t trace_stop(trace_stage s, uint64_t start)
+	{
+		tracer *t = tracer::current;
+		if (__builtin_expect(t == nullptr, 1)) { return 0; }
+		uint64_t now = trace_clock();
+		t->add(s, now - start);
+		return now;
+	}
+
+	/**
+	 * The tracers of every RX thread, merged on demand for reporting. The
+	 * merge reads each thread's histograms while it keeps recording, so
+	 * a report can be a frame or two out of date.
+	 */
+	class trace_set : private nocopy, private nomove
+	{
+		trace_config cfg;
+		double ticks_per_ns;
+		mutable std::mutex lock;
+		std::vector<std::unique_ptr<tracer>> tracers;
+
+		uint64_t ns(uint64_t ticks) const { return (uint64_t)(ticks / ticks_per_ns); }
+
+	public:
+		explicit trace_set(const trace_config &cfg);
+
+		// A new tracer for one device, which lives as long as the set.
+		tracer &attach();
+
+		/**
+		 * Adds the count, percentiles and maximum of each stage, in
+		 * nanoseconds, to out.
+		 */
+		void collect(counter_set &out) const;
+
+		/**
+		 * Formats the slowest traced frames across all threads, slowest
+		 * first, one "#" comment line each with the time spent in every
+		 * stage, the Ethernet header, and the start of the frame in hex.
+		 */
+		std::string slowest() const;
+	};
+}
+
+#endif
@@ -0,0 +1,555 @@
+#include "uring.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <climits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+using namespace unet;
+
+// Added in Linux 6.7, after some of the uapi headers we build against.
+#define UNET_IORING_OP_READ_MULTISHOT 49
+
+#define RX_TAG  (1ull << 63)
+#define RX_BGID 0
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void *map_ring(size_t len, int fd, off_t off)
+{
+	return mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, off);
+}
+
+std::error_code uring::open(unsigned int entries)
+{
+	struct io_uring_params p;
+	void *sq = MAP_FAILED, *cq = MAP_FAILED, *e = MAP_FAILED;
+	std::error_code ec;
+	int s;
+
+	memset(&p, 0, sizeof(p));
+	if ((s = sys_setup(entries, &p)) < 0) {
+		return std::error_code(errno, std::system_category());
+	}
+
+	size_t slen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t clen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t elen = p.sq_entries * sizeof(struct io_uring_sqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+
+	if (single) {
+		slen = clen = std::max(slen, clen);
+	}
+
+	if ((sq = map_ring(slen, s, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	cq = single ? sq : map_ring(clen, s, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	if ((e = map_ring(elen, s, IORING_OFF_SQES)) == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+
+	close();
+	fd = s;
+	sq_map = static_cast<uint8_t *>(sq);
+	cq_map = static_cast<uint8_t *>(cq);
+	sq_len = slen;
+	cq_len = single ? 0 : clen;
+	sqes_len = elen;
+
+	sq_head = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.tail);
+	sq_array = reinterpret_cast<unsigned int *>(sq_map + p.sq_off.array);
+	sq_mask = *reinterpret_cast<unsigned int *>(sq_map + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	sq_local = *sq_tail;
+	sqes = static_cast<struct io_uring_sqe *>(e);
+
+	cq_head = reinterpret_cast<unsigned int *>(cq_map + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int *>(cq_map + p.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned int *>(cq_map + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe *>(cq_map + p.cq_off.cqes);
+	return ec;
+
+fail:
+	if (e != MAP_FAILED) { munmap(e, elen); }
+	if (cq != MAP_FAILED && cq != sq) { munmap(cq, clen); }
+	if (sq != MAP_FAILED) { munmap(sq, slen); }
+	while (::close(s) < 0 && errno == EINTR) {}
+	return ec;
+}
+
+void uring::close()
+{
+	if (fd < 0) { return; }
+	munmap(sqes, sqes_len);
+	if (cq_len) { munmap(cq_map, cq_len); }
+	munmap(sq_map, sq_len);
+	while (::close(fd) < 0 && errno == EINTR) {}
+	fd = -1;
+	sq_map = cq_map = nullptr;
+	sq_len = cq_len = sqes_len = 0;
+	sqes = nullptr;
+	cqes = nullptr;
+}
+
+struct io_uring_sqe *uring::get_sqe()
+{
+	unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sq_local - head >= sq_entries) { return nullptr; }
+
+	unsigned int idx = sq_local++ & sq_mask;
+	struct io_uring_sqe *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	return sqe;
+}
+
+unsigned int uring::pending() const
+{
+	return sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+std::error_code uring::submit(unsigned int wait)
+{
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+
+	unsigned int n = pending();
+	if (n == 0 && wait == 0) { return std::error_code(); }
+
+	if (sys_enter(fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) { return std::error_code(); }
+		return std::error_code(errno, std::system_category());
+	}
+	return std::error_code();
+}
+
+struct io_uring_cqe *uring::peek()
+{
+	unsigned int head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) { return nullptr; }
+	return &cqes[head & cq_mask];
+}
+
+void uring::advance()
+{
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+std::error_code uring::register_op(unsigned int op, void *arg, unsigned int n)
+{
+	if (sys_register(fd, op, arg, n) < 0) {
+		return std::error_code(errno, std::system_category());
+	}
+	return std::error_code();
+}
+
+std::error_code uring_io::open(int f, const uring_config &c)
+{
+	struct io_uring_buf_reg reg;
+	struct iovec iov;
+	void *m;
+	std::error_code ec;
+
+	close();
+
+	if (c.rx_buffers == 0 || c.rx_buffers > 32768 || (c.rx_buffers & (c.rx_buffers - 1))) {
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+
+	cfg = c;
+	fd = f;
+
+	if ((ec = ring.open(cfg.entries))) { goto fail; }
+
+	br_len = cfg.rx_buffers * sizeof(struct io_uring_buf);
+	m = mmap(nullptr, br_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+	br = static_cast<struct io_uring_buf_ring *>(m);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(br);
+	reg.ring_entries = cfg.rx_buffers;
+	reg.bgid = RX_BGID;
+	if ((ec = ring.register_op(IORING_REGISTER_PBUF_RING, &reg, 1))) { goto fail; }
+
+	bufs.assign(cfg.rx_buffers, nullptr);
+	empty.clear();
+	for (unsigned int i = cfg.rx_buffers; i > 0; i--) {
+		empty.push_back(i - 1);
+	}
+
+	slots_len = (size_t)cfg.tx_slots * cfg.slot_size;
+	m = mmap(nullptr, slots_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		ec = std::error_code(errno, std::system_category());
+		goto fail;
+	}
+	slots = static_cast<uint8_t *>(m);
+
+	// Fixed writes skip the per-request page pinning, but registration
+	// counts against RLIMIT_MEMLOCK; plain writes work without it.
+	iov.iov_base = slots;
+	iov.iov_len = slots_len;
+	fixed = !ring.register_op(IORING_REGISTER_BUFFERS, &iov, 1);
+
+	free_slots.clear();
+	for (unsigned int i = cfg.tx_slots; i > 0; i--) {
+		free_slots.push_back(i - 1);
+	}
+	held.reset(new buffer_list[cfg.tx_slots]);
+	iovs.reset(new struct iovec[(size_t)cfg.tx_slots * UNET_MAX_SEGS]);
+	return ec;
+
+fail:
+	close();
+	return ec;
+}
+
+void uring_io::close()
+{
+	ring.close();
+
+	while (!stash.is_empty()) {
+		stash.pop_front();
+	}
+	for (auto *b : bufs) {
+		if (b) { buffer_delete()(b); }
+	}
+	bufs.clear();
+	empty.clear();
+	free_slots.clear();
+	held.reset();
+	iovs.reset();
+
+	if (br) { munmap(br, br_len); }
+	if (slots) { munmap(slots, slots_len); }
+	br = nullptr;
+	br_len = 0;
+	br_tail = 0;
+	slots = nullptr;
+	slots_len = 0;
+	fixed = false;
+	pool = nullptr;
+	armed = false;
+	fd = -1;
+}
+
+std::error_code uring_io::start(buffer_pool &p)
+{
+	pool = &p;
+	refill();
+	return arm();
+}
+
+std::error_code uring_io::arm()
+{
+	struct io_uring_sqe *sqe = ring.get_sqe();
+	if (sqe == nullptr) {
+		auto ec = ring.submit();
+		if (ec) { return ec; }
+		if ((sqe = ring.get_sqe()) == nullptr) {
+			return std::make_error_code(std::errc::device_or_resource_busy);
+		}
+	}
+
+	sqe->opcode = UNET_IORING_OP_READ_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->buf_group = RX_BGID;
+	sqe->user_data = RX_TAG;
+	armed = true;
+	return std::error_code();
+}
+
+void uring_io::refill()
+{
+	unsigned int mask = cfg.rx_buffers - 1;
+	bool added = false;
+
+	while (!empty.empty()) {
+		buffer *b = pool->acquire();
+		if (b == nullptr) { break; }
+
+		uint16_t bid = empty.back();
+		empty.pop_back();
+		bufs[bid] = b;
+
+		// Not br->bufs: the uapi flex array sits behind an empty struct,
+		// which has a non-zero size in C++ and shifts the entries.
+		struct io_uring_buf &e = reinterpret_cast<struct io_uring_buf *>(br)[br_tail & mask];
+		e.addr = reinterpret_cast<uintptr_t>(b->data());
+		e.len = b->available();
+		e.bid = bid;
+		br_tail++;
+		added = true;
+	}
+
+	if (added) {
+		__atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+	}
+}
+
+std::error_code uring_io::reap(buffer_list &list, unsigned int max, unsigned int &count)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = ring.peek()) != nullptr) {
+		if (cqe->user_data != RX_TAG) {
+			held[cqe->user_data].clear();
+			free_slots.push_back((uint16_t)cqe->user_data);
+			if (cqe->res < 0) { tx_errors++; }
+			ring.advance();
+			continue;
+		}
+
+		if (count >= max) { break; }
+
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+		ring.advance();
+
+		if (!(flags & IORING_CQE_F_MORE)) { armed = false; }
+
+		if (flags & IORING_CQE_F_BUFFER) {
+			uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			buffer *b = bufs[bid];
+			bufs[bid] = nullptr;
+			empty.push_back(bid);
+			if (res > 0) {
+				b->bump((unsigned int)res);
+				list.push_back(*b);
+				count++;
+				continue;
+			}
+			buffer_delete()(b);
+		}
+
+		if (res == 0) {
+			return std::error_code(EBADF, std::system_category());
+		}
+		// Running out of provided buffers ends the multishot read; it is
+		// re-armed once the ring has been refilled.
+		if (res < 0 && res != -ENOBUFS && res != -EINTR && res != -EAGAIN) {
+			return std::error_code(-res, std::system_category());
+		}
+	}
+	return std::error_code();
+}
+
+std::error_code uring_io::read_burst(buffer_list &list, buffer_pool &p, unsigned int max)
+{
+	std::error_code ec;
+	unsigned int count = 0;
+
+	if (pool == nullptr && (ec = start(p))) {
+		return ec;
+	}
+
+	while (count < max && !stash.is_empty()) {
+		list.push_back(stash.front());
+		count++;
+	}
+
+	for (;;) {
+		if ((ec = reap(list, max, count))) { return ec; }
+
+		refill();
+		if (empty.size() == cfg.rx_buffers && count == 0) {
+			return std::make_error_code(std::errc::not_enough_memory);
+		}
+		if (!armed && (ec = arm())) { return ec; }
+
+		// One enter both submits queued TX and, when idle, waits for RX.
+		if (count > 0) { return ring.submit(); }
+		if ((ec = ring.submit(1))) { return ec; }
+	}
+}
+
+// Before start there is no ring to read through, so reads wait on the
+// nonblocking fd the way tun_device::read does.
+std::error_code uring_io::read_fd(buffer &buf)
+{
+	for (;;) {
+		slice end = buf.end();
+		ssize_t n = ::read(fd, end.value(), end.length());
+		if (n > 0) {
+			buf.bump((size_t)n);
+			return std::error_code();
+		}
+		if (n == 0) { return std::error_code(EBADF, std::system_category()); }
+		if (errno == EAGAIN) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				return std::error_code(errno, std::system_category());
+			}
+		}
+		else if (errno != EINTR) {
+			return std::error_code(errno, std::system_category());
+		}
+	}
+}
+
+std::error_code uring_io::read(buffer &buf)
+{
+	if (pool == nullptr) {
+		return read_fd(buf);
+	}
+
+	buffer_list one;
+	auto ec = read_burst(one, *pool, 1);
+	if (!ec) {
+		slice src = one.front().begin();
+		slice end = buf.end();
+		buf.bump(src.copy(end.value(), end.length()));
+	}
+	return ec;
+}
+
+std::error_code uring_io::take_slot(uint16_t &slot, struct io_uring_sqe *&sqe)
+{
+	while (free_slots.empty()) {
+		unsigned int n = 0;
+		auto ec = ring.submit(1);
+		if (!ec) { ec = reap(stash, UINT_MAX, n); }
+		if (ec) { return ec; }
+	}
+
+	sqe = ring.get_sqe();
+	if (sqe == nullptr) {
+		ring.submit();
+		if ((sqe = ring.get_sqe()) == nullptr) {
+			return std::make_error_code(std::errc::device_or_resource_busy);
+		}
+	}
+
+	slot = free_slots.back();
+	free_slots.pop_back();
+	return std::error_code();
+}
+
+ssize_t uring_io::write(const slice &buf)
+{
+	if (buf.length() > cfg.slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	uint16_t slot;
+	struct io_uring_sqe *sqe;
+	auto ec = take_slot(slot, sqe);
+	if (ec) {
+		errno = ec.value();
+		return -1;
+	}
+
+	uint8_t *p = slots + (size_t)slot * cfg.slot_size;
+	memcpy(p, buf.value(), buf.length());
+
+	sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->addr = reinterpret_cast<uintptr_t>(p);
+	sqe->len = buf.length();
+	sqe->buf_index = 0;
+	sqe->user_data = slot;
+	return buf.length();
+}
+
+ssize_t uring_io::write(buffer_list &pkt)
+{
+	size_t len = 0, copy = 0;
+	unsigned int n = 0;
+	for (auto &seg : pkt) {
+		len += seg.length();
+		if (seg.is_external()) { copy += seg.length(); }
+		n++;
+	}
+	if (n > UNET_MAX_SEGS || copy > cfg.slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	uint16_t slot;
+	struct io_uring_sqe *sqe;
+	auto ec = take_slot(slot, sqe);
+	if (ec) {
+		errno = ec.value();
+		return -1;
+	}
+
+	uint8_t *p = slots + (size_t)slot * cfg.slot_size;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->buf_index = 0;
+	sqe->user_data = slot;
+
+	// A frame that fits a slot is cheaper to copy than to pin.
+	if (len <= cfg.slot_size) {
+		for (auto &seg : pkt) {
+			memcpy(p, seg.data(), seg.length());
+			p += seg.length();
+		}
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->addr = reinterpret_cast<uintptr_t>(slots + (size_t)slot * cfg.slot_size);
+		sqe->len = len;
+		return len;
+	}
+
+	// Segments in device memory won't outlive the next read, so only
+	// those are copied; the rest move to the slot until the CQE.
+	struct iovec *iov = &iovs[(size_t)slot * UNET_MAX_SEGS];
+	unsigned int i = 0;
+	for (auto &seg : pkt) {
+		if (seg.is_external()) {
+			memcpy(p, seg.data(), seg.length());
+			iov[i++] = { p, seg.length() };
+			p += seg.length();
+		}
+		else {
+			iov[i++] = { seg.data(), seg.length() };
+			held[slot].push_back(seg);
+		}
+	}
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->addr = reinterpret_cast<uintptr_t>(iov);
+	sqe->len = i;
+	return len;
+}
+
+std::error_code uring_io::flush()
+{
+	return ring.submit();
+}
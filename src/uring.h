@@ -0,0 +1,135 @@
+#ifndef UNET_URING_H
+#define UNET_URING_H
+
+#include <vector>
+#include <memory>
+#include <system_error>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "base.h"
+#include "buffer.h"
+#include "slice.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+struct iovec;
+
+namespace unet
+{
+	class buffer_pool;
+
+	/**
+	 * Minimal io_uring instance driven through the raw system calls.
+	 */
+	class uring : private nocopy, private nomove
+	{
+		int fd = -1;
+		uint8_t *sq_map = nullptr;
+		uint8_t *cq_map = nullptr;
+		size_t sq_len = 0;
+		size_t cq_len = 0;
+		size_t sqes_len = 0;
+
+		unsigned int *sq_head = nullptr;
+		unsigned int *sq_tail = nullptr;
+		unsigned int *sq_array = nullptr;
+		unsigned int sq_mask = 0;
+		unsigned int sq_entries = 0;
+		unsigned int sq_local = 0;
+		struct io_uring_sqe *sqes = nullptr;
+
+		unsigned int *cq_head = nullptr;
+		unsigned int *cq_tail = nullptr;
+		unsigned int cq_mask = 0;
+		struct io_uring_cqe *cqes = nullptr;
+
+	public:
+		uring() {}
+		~uring() { close(); }
+
+		std::error_code open(unsigned int entries);
+		void close();
+
+		int handle() const { return fd; }
+
+		struct io_uring_sqe *get_sqe();
+		unsigned int pending() const;
+		std::error_code submit(unsigned int wait = 0);
+
+		struct io_uring_cqe *peek();
+		void advance();
+
+		std::error_code register_op(unsigned int op, void *arg, unsigned int n);
+	};
+
+	struct uring_config
+	{
+		unsigned int entries = 256;     /* submission queue entries */
+		unsigned int rx_buffers = 256;  /* provided RX buffers, a power of 2 */
+		unsigned int tx_slots = 256;    /* in-flight TX frames */
+		unsigned int slot_size = 2048;  /* octets per TX frame */
+	};
+
+	/**
+	 * Frame I/O on a file descriptor through io_uring. RX is a multishot
+	 * read that picks buffers from a provided-buffer ring filled from a
+	 * buffer_pool, so completed frames are ordinary pool buffers. TX copies
+	 * into registered slots and queues write SQEs that are submitted with
+	 * the next RX wait, or explicitly with flush. Chained frames too big for
+	 * a slot are written with writev straight from their segments, which
+	 * are held until the write completes.
+	 *
+	 * Not thread safe: reads and writes must come from the RX thread.
+	 */
+	class uring_io : private nocopy, private nomove
+	{
+		uring ring;
+		int fd = -1;
+		uring_config cfg;
+
+		struct io_uring_buf_ring *br = nullptr;
+		size_t br_len = 0;
+		uint16_t br_tail = 0;
+		std::vector<buffer *> bufs;
+		std::vector<uint16_t> empty;
+		buffer_pool *pool = nullptr;
+		bool armed = false;
+
+		uint8_t *slots = nullptr;
+		size_t slots_len = 0;
+		bool fixed = false;
+		std::vector<uint16_t> free_slots;
+		std::unique_ptr<buffer_list[]> held;     /* segments per slot */
+		std::unique_ptr<struct iovec[]> iovs;    /* UNET_MAX_SEGS per slot */
+		size_t tx_errors = 0;
+
+		buffer_list stash;
+
+		std::error_code start(buffer_pool &pool);
+		std::error_code arm();
+		void refill();
+		std::error_code reap(buffer_list &list, unsigned int max, unsigned int &count);
+		std::error_code read_fd(buffer &buf);
+		std::error_code take_slot(uint16_t &slot, struct io_uring_sqe *&sqe);
+
+	public:
+		uring_io() {}
+		~uring_io() { close(); }
+
+		std::error_code open(int fd, const uring_config &cfg = uring_config());
+		void close();
+
+		std::error_code read_burst(buffer_list &list, buffer_pool &pool, unsigned int max);
+		std::error_code read(buffer &buf);
+		ssize_t write(const slice &buf);
+		ssize_t write(buffer_list &pkt);
+		std::error_code flush();
+
+		size_t errors() const { return tx_errors; }
+	};
+}
+
+#endif
+
@@ -0,0 +1,202 @@
+#include "vlan.h"
+#include "fmt.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+using namespace unet;
+
+static inline bool valid_vid(uint16_t vid)
+{
+	return vid != 0 && vid < UNET_VLAN_N_VID - 1;
+}
+
+static inline uint8_t *put_tag(uint8_t *p, eth_type tpid, uint16_t vid)
+{
+	uint16_t v[2] = { hton16(tpid), hton16(vid) };
+	memcpy(p, v, sizeof(v));
+	return p + sizeof(v);
+}
+
+vlan_device::vlan_device(device &trunk, uint16_t vid, uint16_t svid) :
+	trunk(trunk)
+{
+	queue_with(trunk);
+
+	uint8_t *p = tags;
+	if (svid) {
+		p = put_tag(p, ETH_IEEE8021AD, svid);
+	}
+	p = put_tag(p, ETH_IEEE8021Q, vid);
+	tags_len = p - tags;
+
+	char suffix[16];
+	if (svid) { snprintf(suffix, sizeof(suffix), ".%u.%u", svid, vid); }
+	else { snprintf(suffix, sizeof(suffix), ".%u", vid); }
+	name = trunk.ifname() + suffix;
+}
+
+std::error_code vlan_device::open(const char *a, const char *hwa)
+{
+	uint32_t new_addr = 0;
+	uint8_t new_hwaddr[6];
+
+	if (inet_pton(AF_INET, a, &new_addr) != 1) {
+		return error::invalid_ipaddr;
+	}
+
+	if (hwa == nullptr) {
+		memcpy(new_hwaddr, trunk.hwaddr(), sizeof(new_hwaddr));
+	}
+	else if (sscanf(hwa, UNET_MAC_FMT, UNET_MAC_ARG(&new_hwaddr)) != UNET_MAC_NARG) {
+		return error::invalid_hwaddr;
+	}
+
+	addr = new_addr;
+	memcpy(hw, new_hwaddr, sizeof(hw));
+	return std::error_code();
+}
+
+vlan_demux::vlan_demux(device &trunk, eth &native) :
+	trunk(trunk),
+	native(native)
+{
+	native.attach(ETH_IEEE8021Q, recv_tagged, this);
+	for (eth_type type : { ETH_IEEE8021AD, ETH_QINQ1, ETH_QINQ2, ETH_QINQ3 }) {
+		native.attach(type, recv_stacked, this);
+	}
+	native.set_tick(tick, this);
+}
+
+vlan_demux::~vlan_demux()
+{
+	for (eth_type type : { ETH_IEEE8021Q, ETH_IEEE8021AD, ETH_QINQ1, ETH_QINQ2, ETH_QINQ3 }) {
+		native.detach(type);
+	}
+	native.set_tick(nullptr, nullptr);
+}
+
+std::error_code vlan_demux::add(uint16_t vid, uint16_t svid, const char *ipaddr, const char *hwaddr, arp_cache &cache)
+{
+	if (!valid_vid(vid) || (svid && !valid_vid(svid))) {
+		return std::make_error_code(std::errc::invalid_argument);
+	}
+	if (find(vid, svid)) {
+		return std::make_error_code(std::errc::file_exists);
+	}
+
+	// The device needs its address before a stack is built on it.
+	std::unique_ptr<vlan_device> dev(new vlan_device(trunk, vid, svid));
+	auto ec = dev->open(ipaddr, hwaddr);
+	if (ec) { return ec; }
+
+	table *t = &vlans;
+	if (svid) {
+		if (!svlans[svid]) { svlans[svid].reset(new table); }
+		t = svlans[svid].get();
+	}
+	segments.emplace_back(new segment(std::move(dev), cache));
+	t->seg[vid] = segments.back().get();
+	return std::error_code();
+}
+
+eth *vlan_demux::find(uint16_t vid, uint16_t svid) const
+{
+	const table *t = svid ? svlans[svid & (UNET_VLAN_N_VID - 1)].get() : &vlans;
+	segment *seg = t ? t->seg[vid & (UNET_VLAN_N_VID - 1)] : nullptr;
+	return seg ? &seg->stack : nullptr;
+}
+
+static void strip_tags(buffer &frame, unsigned int tags)
+{
+	// The addresses move up over the tags, which leaves the type of the
+	// innermost in place as the frame's own.
+	unsigned int n = tags * UNET_VLAN_HLEN;
+	uint8_t *p = frame.data();
+	memmove(p + n, p, 2 * UNET_ETH_ALEN);
+	frame.pull(n);
+
+	buffer_offload &ol = frame.offload();
+	if (ol.needs_csum()) { ol.csum_start -= n; }
+	if (ol.hdr_len) { ol.hdr_len -= n; }
+}
+
+void vlan_demux::deliver(segment *seg, buffer &frame, unsigned int tags)
+{
+	if (seg == nullptr) {
+		st->unknown++;
+		return;
+	}
+	strip_tags(frame, tags);
+	seg->stack.deliver(frame);
+}
+
+void vlan_demux::recv_tagged(void *ctx, buffer &frame, const slice &payload)
+{
+	vlan_demux &self = *static_cast<vlan_demux *>(ctx);
+	self.st->received++;
+	if (payload.length() < UNET_VLAN_HLEN) {
+		self.st->bad++;
+		return;
+	}
+
+	// A tag with VLAN ID 0 only carries a priority, so the frame belongs
+	// to the untagged stack.
+	const vlan_hdr &tag = payload.as<vlan_hdr>();
+	if (tag.vid() == 0) {
+		strip_tags(frame, 1);
+		self.native.dispatch(frame);
+		return;
+	}
+	self.deliver(self.vlans.seg[tag.vid()], frame, 1);
+}
+
+void vlan_demux::recv_stacked(void *ctx, buffer &frame, const slice &payload)
+{
+	vlan_demux &self = *static_cast<vlan_demux *>(ctx);
+	self.st->received++;
+	if (payload.length() < 2 * UNET_VLAN_HLEN) {
+		self.st->bad++;
+		return;
+	}
+
+	const vlan_hdr &outer = payload.as<vlan_hdr>();
+	if (outer.type() != ETH_IEEE8021Q) {
+		self.st->bad++;
+		return;
+	}
+
+	const vlan_hdr &inner = *reinterpret_cast<const vlan_hdr *>(outer.payload);
+	const table *t = self.svlans[outer.vid()].get();
+	self.deliver(t ? t->seg[inner.vid()] : nullptr, frame, 2);
+}
+
+void vlan_demux::tick(void *ctx, uint64_t now)
+{
+	// Ticks come once a burst, but the clock only moves every millisecond,
+	// so the stacks are only visited when there may be timers due.
+	vlan_demux &self = *static_cast<vlan_demux *>(ctx);
+	if (now == self.last_tick) { return; }
+	self.last_tick = now;
+	for (auto &seg : self.segments) {
+		seg->stack.tick(now);
+	}
+}
+
+void vlan_demux::collect(counter_set &out) const
+{
+	out.add("vlan.segments", segments.size());
+	out.add("vlan.received", st->received);
+	out.add("vlan.bad", st->bad);
+	out.add("vlan.unknown", st->unknown);
+
+	// The stacks count under names of their own, apart from the trunk's
+	// stack, which has already counted every tagged frame once.
+	out.set_prefix("vlan.");
+	for (auto &seg : segments) {
+		seg->dev->collect(out);
+		seg->stack.collect(out);
+	}
+	out.set_prefix("");
+}
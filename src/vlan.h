@@ -0,0 +1,154 @@
+#ifndef UNET_VLAN_H
+#define UNET_VLAN_H
+
+#include <memory>
+#include <vector>
+#include <system_error>
+#include <cstdint>
+
+#include "base.h"
+#include "device.h"
+#include "eth.h"
+#include "stats.h"
+
+namespace unet
+{
+	/**
+	 * The part of an 802.1Q tag after its TPID, which takes the place of
+	 * the Ethernet type: the TCI, then the type of what follows.
+	 */
+	struct vlan_hdr
+	{
+		uint16_t tci;
+		uint16_t _type;
+		uint8_t  payload[0];
+
+		constexpr uint16_t vid() const { return ntoh16(tci) & (UNET_VLAN_N_VID - 1); }
+		constexpr uint16_t type() const { return ntoh16(_type); }
+	} __attribute__((packed));
+
+	static_assert(sizeof(vlan_hdr) == UNET_VLAN_HLEN, "vlan_hdr size invalid");
+
+	/**
+	 * One VLAN on a trunk device, with an address of its own. Frames sent
+	 * through it are tagged as they are built and written to the trunk,
+	 * in the same batch as the trunk's own, where they are counted; it
+	 * receives nothing itself, as vlan_demux hands it what arrives on the
+	 * trunk.
+	 */
+	class vlan_device final : public device, private nomove
+	{
+		device &trunk;
+
+	protected:
+		std::error_code submit_tx() override { return trunk.flush(); }
+
+	public:
+		/**
+		 * Tags frames with vid, behind an 802.1ad service tag for svid if
+		 * it isn't 0.
+		 */
+		vlan_device(device &trunk, uint16_t vid, uint16_t svid = 0);
+		~vlan_device() { close(); }
+
+		// Takes the trunk's hardware address if hwaddr is null.
+		std::error_code open(const char *ipaddr, const char *hwaddr = nullptr);
+
+		void close() override { reset(); }
+
+		std::error_code read_burst(buffer_list &, buffer_pool &, unsigned int) override
+		{
+			return std::make_error_code(std::errc::operation_not_supported);
+		}
+
+		std::error_code read(buffer &) override
+		{
+			return std::make_error_code(std::errc::operation_not_supported);
+		}
+
+		ssize_t write(const slice &buf, const buffer_offload &ol) override { return trunk.write(buf, ol); }
+		ssize_t write(buffer_list &pkt, const buffer_offload &ol) override { return trunk.write(pkt, ol); }
+	};
+
+	/**
+	 * Splits the tagged frames a trunk receives into a stack per VLAN,
+	 * each on a vlan_device with its own address and ARP cache. Frames
+	 * with one 802.1Q tag are looked up by VLAN ID in a direct table;
+	 * QinQ frames, with an 802.1ad (or older 0x9x00) service tag outside
+	 * an 802.1Q one, by service VLAN ID first, in a table of such tables.
+	 * Tags are stripped in place before the frame goes up, so the stack
+	 * sees an untagged frame with room in front to tag its replies.
+	 * Untagged frames stay with the trunk's own stack, as do priority
+	 * tagged ones, with VLAN ID 0, once their tag is stripped.
+	 */
+	class vlan_demux : private nocopy, private nomove
+	{
+	public:
+		struct stats
+		{
+			size_t received;      /* tagged frames */
+			size_t bad;           /* frames too short for their tags, or QinQ without an inner tag */
+			size_t unknown;       /* frames for a VLAN with no stack */
+		};
+
+	private:
+		struct segment
+		{
+			std::unique_ptr<vlan_device> dev;
+			eth stack;
+
+			segment(std::unique_ptr<vlan_device> d, arp_cache &cache) :
+				dev(std::move(d)),
+				stack(*dev, cache)
+			{}
+		};
+
+		struct table
+		{
+			segment *seg[UNET_VLAN_N_VID] = {};
+		};
+
+		device &trunk;
+		eth &native;
+		padded<stats> st;
+		uint64_t last_tick = 0;
+		std::vector<std::unique_ptr<segment>> segments;
+		table vlans;
+		std::unique_ptr<table> svlans[UNET_VLAN_N_VID];
+
+		void deliver(segment *seg, buffer &frame, unsigned int tags);
+
+		static void recv_tagged(void *ctx, buffer &frame, const slice &payload);
+		static void recv_stacked(void *ctx, buffer &frame, const slice &payload);
+		static void tick(void *ctx, uint64_t now);
+
+	public:
+		/**
+		 * Takes over the tagged types on native, the stack of the trunk,
+		 * until destroyed. Only the thread that runs native may use it.
+		 */
+		vlan_demux(device &trunk, eth &native);
+		~vlan_demux();
+
+		/**
+		 * Adds a stack for frames tagged vid, inside service VLAN svid if
+		 * it isn't 0, sending from ipaddr and hwaddr, or the trunk's
+		 * hardware address if that is null. Threads serving queues of
+		 * the same trunk can share cache.
+		 */
+		std::error_code add(uint16_t vid, uint16_t svid, const char *ipaddr, const char *hwaddr, arp_cache &cache);
+
+		// The stack for a VLAN, or null if there isn't one.
+		eth *find(uint16_t vid, uint16_t svid = 0) const;
+
+		const stats &get_stats() const { return *st; }
+
+		/**
+		 * Adds the VLAN counters, and those of every VLAN's device and
+		 * stack, summed under names prefixed with "vlan.", to out.
+		 */
+		void collect(counter_set &out) const;
+	};
+}
+
+#endif